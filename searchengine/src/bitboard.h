@@ -2,6 +2,7 @@
 #define BITBOARD_H
 
 #include <iostream>
+#include <bit>
 #include <immintrin.h>
 
 #include "types.h"
@@ -52,6 +52,64 @@ void Engine::go(const SearchLimits& limits) {
 }
 
 
+void Engine::clear_tt() {
+    threads.wait_search_finished();
+    tt.clear(threads.size());
+}
+
+
+bool Engine::save_tt(const std::string& path) {
+    threads.wait_search_finished();
+    return tt.save(path);
+}
+
+
+bool Engine::load_tt(const std::string& path) {
+    threads.wait_search_finished();
+    return tt.load(path);
+}
+
+
+bool Engine::load_eval_file() {
+    if (evalFile == loadedEvalFile)
+        return true;
+
+    threads.wait_search_finished();
+
+    bool loaded = true;
+    if (evalFile.empty())
+        nnue->load_embedded();
+    else if (!nnue->load(evalFile)) {
+        nnue->load_embedded();
+        loaded = false;
+    }
+    loadedEvalFile = loaded ? evalFile : "";
+
+    // the cached evaluations and accumulators were computed with the previous network
+    for (auto& thread : threads)
+        thread->reset_nnue();
+
+    return loaded;
+}
+
+
+void Engine::print_stats() {
+    threads.wait_search_finished();
+    TTStats stats;
+    uint64_t evalProbes = 0, evalHits = 0;
+    for (auto& thread : threads) {
+        stats += thread->tt_stats();
+        evalProbes += thread->eval_cache().get_probes();
+        evalHits += thread->eval_cache().get_hits();
+    }
+    tt.print_stats(stats);
+
+    double hitRate = evalProbes ? 100.0 * evalHits / evalProbes : 0.0;
+    std::cout << "Eval cache probes: " << evalProbes << std::endl;
+    std::cout << "Eval cache hits:   " << evalHits << " (" << hitRate << "%)" << std::endl;
+}
+
+
 void Engine::stop() {
     threads.master().set_stop(true);
     threads.wait_search_finished();
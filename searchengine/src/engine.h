@@ -1,6 +1,8 @@
 #ifndef ENGINE_H
 #define ENGINE_H
 
+#include <memory>
+
 #include "search.h"
 #include "opening_book.h"
 
@@ -12,20 +14,38 @@ void init();
 
 class Engine {
     public:
-        Engine(OutputManager& outputManager) : 
-            outputManager(outputManager),
-            threads(tt, threads, outputManager, nnue) 
+        // several engines can share the same (read-only) network, e.g. for data generation
+        Engine(OutputManager& outputManager,
+               std::shared_ptr<NNUE::NNUE> nnue = std::make_shared<NNUE::NNUE>()) : 
+            nnue(nnue),
+            threads(tt, threads, outputManager, *this->nnue),
+            outputManager(outputManager)
         {
             init();
         }
 
         // options
-        void resize_tt(size_t size) { tt.resize(size); }
+        void resize_tt(size_t size) { tt.resize(size, threads.size()); }
         void resize_threadpool(size_t numThreads) { threads.resize(numThreads); }
         void set_move_overhead(int overhead) { threads.master().set_move_overhead(overhead); }
         void set_own_book(bool ownBook) { this->ownBook = ownBook; }
+        // the network file is only loaded by load_eval_file (at isready)
+        void set_eval_file(const std::string& path) { evalFile = path; }
+
+        // load the network set with the EvalFile option if it changed, waiting for the search
+        // to finish first. the embedded network is used for an empty path or if the file
+        // can't be loaded (returns false in that case)
+        bool load_eval_file();
+
+        // dump and reload the transposition table, waiting for the search to finish first
+        bool save_tt(const std::string& path);
+        bool load_tt(const std::string& path);
+        // sums the transposition table and eval cache stats of the threads and prints them
+        void print_stats();
 
         void new_game();
+        // clears the transposition table, waiting for the search to finish first
+        void clear_tt();
         void set_position(const std::string& sfen, const std::vector<std::string>& moves = {});
         void go(const SearchLimits& limits);
         void stop();
@@ -34,11 +54,13 @@ class Engine {
     private:
         Position pos;
         TTable tt;
-        NNUE::NNUE nnue;
+        std::shared_ptr<NNUE::NNUE> nnue;
         ThreadPool<Worker> threads;
         OutputManager& outputManager;
         OpeningBook openingBook;
         bool ownBook = true;
+        // requested and currently loaded network files (empty for the embedded network)
+        std::string evalFile, loadedEvalFile;
 };
 
 
@@ -103,7 +103,8 @@ int evaluate(Position& pos) {
 }
 
 
-int evaluate_nnue(NNUE::NNUE& nnue, NNUE::AccumulatorType& acc, Position& pos) {
+int evaluate_nnue(NNUE::NNUE& nnue, NNUE::AccumulatorStack& accStack, Position& pos,
+                  EvalCache& cache) {
     // if the game is over, return the winning score
     if (pos.is_game_over()) {
         // if the game is over, the side to move has lost
@@ -113,9 +114,16 @@ int evaluate_nnue(NNUE::NNUE& nnue, NNUE::AccumulatorType& acc, Position& pos) {
             return -WIN_SCORE;
     }
 
+    // the game over check depends on the game history, only the nnue evaluation is cached
+    int eval;
+    if (cache.probe(pos.get_key(), eval))
+        return eval;
+
     // evaluate the position from the accumulator
-    return std::clamp(nnue.evaluate(acc, pos.side_to_move()), -WIN_SCORE+1, WIN_SCORE-1);
-}
+    eval = std::clamp(nnue.evaluate(accStack, pos), -WIN_SCORE+1, WIN_SCORE-1);
+    cache.store(pos.get_key(), eval);
 
+    return eval;
+}
 
 } // namespace harukashogi
\ No newline at end of file
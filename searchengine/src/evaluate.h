@@ -1,6 +1,9 @@
 #ifndef EVALUATE_H
 #define EVALUATE_H
 
+#include <vector>
+#include <algorithm>
+
 #include "position.h"
 #include "nnue/nnue.h"
 
@@ -9,7 +12,51 @@ namespace harukashogi {
 
 int evaluate(Position& pos);
 
-int evaluate_nnue(NNUE::NNUE& nnue, NNUE::AccumulatorType& acc, Position& pos);
+// number of entries of the eval cache, indexed by the low bits of the key
+constexpr int EVAL_CACHE_BITS = 16;
+constexpr size_t EVAL_CACHE_SIZE = 1ull << EVAL_CACHE_BITS;
+
+// small key indexed cache of the nnue evaluations, one for each search thread.
+// positions reached again through transpositions (frequent in q_search and after null moves)
+// skip the nnue forward pass.
+// each entry is a single 64-bit word: the high bits of the key and the 16 bit evaluation.
+// the low bits of the key are the index, so the whole key is verified.
+class EvalCache {
+    public:
+        EvalCache() : table(EVAL_CACHE_SIZE, 0) {}
+
+        // returns true if the key is in the cache, and sets eval to the cached evaluation
+        bool probe(uint64_t key, int& eval) {
+            probes++;
+            uint64_t entry = table[key & (EVAL_CACHE_SIZE - 1)];
+            if (entry && (entry >> EVAL_CACHE_BITS) == (key >> EVAL_CACHE_BITS)) {
+                hits++;
+                eval = int16_t(entry);
+                return true;
+            }
+            return false;
+        }
+
+        void store(uint64_t key, int eval) {
+            table[key & (EVAL_CACHE_SIZE - 1)] = (key >> EVAL_CACHE_BITS) << EVAL_CACHE_BITS
+                                                | uint16_t(eval);
+        }
+
+        void clear() { std::fill(table.begin(), table.end(), 0); }
+
+        uint64_t get_probes() const { return probes; }
+        uint64_t get_hits() const { return hits; }
+
+    private:
+        std::vector<uint64_t> table;
+
+        uint64_t probes = 0;
+        uint64_t hits = 0;
+};
+
+// the accumulator is only computed (see NNUE::AccumulatorStack) if the evaluation is not cached
+int evaluate_nnue(NNUE::NNUE& nnue, NNUE::AccumulatorStack& accStack, Position& pos,
+                  EvalCache& cache);
 
 constexpr int WIN_SCORE = 32000;
 constexpr int INF_SCORE = 32001;
@@ -1,4 +1,10 @@
 #include <sstream>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "misc.h"
 
@@ -57,4 +63,47 @@ Move move_from_string(const std::string& moveStr) {
 }
 
 
+
+void* large_pages_alloc(size_t size) {
+    constexpr size_t alignment = 2 * 1024 * 1024;
+    // aligned_alloc requires the size to be a multiple of the alignment
+    size = (size + alignment - 1) / alignment * alignment;
+
+    void* mem = std::aligned_alloc(alignment, size);
+    if (!mem)
+        throw std::bad_alloc();
+
+#if defined(MADV_HUGEPAGE)
+    // only a hint, if transparent huge pages are disabled the normal pages are used
+    madvise(mem, size, MADV_HUGEPAGE);
+#endif
+
+    return mem;
+}
+
+
+void large_pages_free(void* mem) {
+    std::free(mem);
+}
+
+
+void* map_file(const std::string& path, size_t offset, size_t size, bool readOnly) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+
+    void* mem = readOnly ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, offset)
+                         : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    // the mapping keeps a reference to the file, the descriptor is not needed anymore
+    close(fd);
+
+    return mem == MAP_FAILED ? nullptr : mem;
+}
+
+
+void unmap_file(void* mem, size_t size) {
+    munmap(mem, size);
+}
+
+
 } // namespace harukashogi
\ No newline at end of file
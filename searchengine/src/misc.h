@@ -29,6 +29,19 @@ std::ostream& operator<<(std::ostream& os, Move m);
 Move move_from_string(const std::string& move_str);
 
 
+// allocates memory aligned to 2MB, advising the OS to back it with transparent huge pages
+// (used for the big tables, where TLB misses are a large part of the access cost)
+void* large_pages_alloc(size_t size);
+void large_pages_free(void* mem);
+
+// memory maps size bytes of a file, starting from offset (must be a multiple of the page size).
+// the mapping is private: the memory can be written, but the changes don't reach the file.
+// a read only mapping is shared instead, its pages are the ones of the page cache.
+// returns nullptr if the file can't be mapped.
+void* map_file(const std::string& path, size_t offset, size_t size, bool readOnly = false);
+void unmap_file(void* mem, size_t size);
+
+
 enum LogLevel : uint8_t {
     SILENT,
     ESSENTIAL,
@@ -12,7 +12,7 @@ namespace NNUE {
 
 template <size_t ACCUMULATOR_SIZE>
 struct Accumulator {
-    int16_t v[2][ACCUMULATOR_SIZE];
+    alignas(64) int16_t v[2][ACCUMULATOR_SIZE];
 
     int16_t* operator [] (Color c) { return v[c]; }
     const int16_t* operator [] (Color c) const { return v[c]; }
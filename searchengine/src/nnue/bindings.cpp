@@ -1,5 +1,6 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
+#include <pybind11/stl.h>
 
 #include "load.h"
 
@@ -36,6 +37,7 @@ py::array_t<T> make_2d_view(const std::vector<T>& vec, size_t rows, size_t cols,
 PYBIND11_MODULE(nnue_loader, m) {
     py::class_<DataBatch, std::shared_ptr<DataBatch>>(m, "DataBatch")
         .def_readonly("batch_size", &DataBatch::batch_size)
+        .def_readonly("skipped", &DataBatch::skipped)
         .def_property_readonly("black_indexes", [](py::object self) {
             auto& b = self.cast<DataBatch&>();
             return make_2d_view(b.black_indexes, b.batch_size, ACTIVE_FEATURES, self);
@@ -44,6 +46,18 @@ PYBIND11_MODULE(nnue_loader, m) {
             auto& b = self.cast<DataBatch&>();
             return make_2d_view(b.white_indexes, b.batch_size, ACTIVE_FEATURES, self);
         })
+        .def_property_readonly("black_kings", [](py::object self) {
+            auto& b = self.cast<DataBatch&>();
+            return make_1d_view(b.black_kings, self);
+        })
+        .def_property_readonly("white_kings", [](py::object self) {
+            auto& b = self.cast<DataBatch&>();
+            return make_1d_view(b.white_kings, self);
+        })
+        .def_property_readonly("buckets", [](py::object self) {
+            auto& b = self.cast<DataBatch&>();
+            return make_1d_view(b.buckets, self);
+        })
         .def_property_readonly("scores", [](py::object self) {
             auto& b = self.cast<DataBatch&>();
             return make_1d_view(b.scores, self);
@@ -58,13 +72,57 @@ PYBIND11_MODULE(nnue_loader, m) {
         });
 
 
+    // iterator over the batches, the loading happens in C++ threads without the GIL
+    py::class_<DataStream, std::shared_ptr<DataStream>>(m, "DataStream")
+        .def(py::init<const std::vector<std::string>&, size_t, bool, size_t, size_t,
+                      bool, bool, bool, size_t>(),
+            py::arg("files"),
+            py::arg("batch_size"),
+            py::arg("shuffle") = true,
+            py::arg("shuffle_buffer") = 1 << 19,
+            py::arg("num_threads") = 0,
+            py::arg("hflip") = false,
+            py::arg("random_hflip") = false,
+            py::arg("halfkp") = false,
+            py::arg("output_buckets") = 1
+        )
+        .def_property_readonly("skipped", &DataStream::skipped)
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", [](DataStream& stream) {
+            std::shared_ptr<DataBatch> batch;
+            {
+                py::gil_scoped_release release;
+                batch = stream.next();
+            }
+            if (!batch)
+                throw py::stop_iteration();
+            return batch;
+        });
+
+
     m.def("load_data_batch",
         &load_data_batch,
         py::arg("file_path"),
         py::arg("hflip") = false,
         py::arg("random_hflip") = false,
+        py::arg("halfkp") = false,
+        py::arg("output_buckets") = 1,
         py::call_guard<py::gil_scoped_release>()
     );
+
+    m.def("evaluate_batch",
+        [](const std::vector<std::string>& sfens, const std::string& eval_file, size_t num_threads) {
+            std::vector<int32_t> evals;
+            {
+                py::gil_scoped_release release;
+                evals = evaluate_batch(sfens, eval_file, num_threads);
+            }
+            return py::array_t<int32_t>(evals.size(), evals.data());
+        },
+        py::arg("sfens"),
+        py::arg("eval_file") = "",
+        py::arg("num_threads") = 0
+    );
 }
 
 
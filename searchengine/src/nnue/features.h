@@ -1,6 +1,8 @@
 #ifndef FEATURES_H
 #define FEATURES_H
 
+#include <cstddef>
+
 #include "../types.h"
 
 namespace harukashogi {
@@ -55,6 +57,79 @@ inline size_t hand_idx(Color c, PieceType pt, int count) {
 }
 
 
+// a feature changed by a move, independent of the perspective.
+// either a piece on a board square or the count-th piece of a type in a hand.
+struct DirtyFeature {
+    Color c;
+    PieceType pt;
+    bool inHand;
+    uint8_t sqOrCount;
+};
+
+
+// the features changed by a move, recorded when the move is made and applied to the
+// accumulator only when it is needed.
+// a move changes at most 2 features in each direction
+// (a capture removes the moving and the captured piece, and adds the moved piece and the hand one)
+struct DirtyPieces {
+    DirtyFeature added[2];
+    DirtyFeature removed[2];
+    uint8_t numAdded = 0;
+    uint8_t numRemoved = 0;
+
+    void add(DirtyFeature f) { added[numAdded++] = f; }
+    void remove(DirtyFeature f) { removed[numRemoved++] = f; }
+};
+
+
+template <Color perspective>
+inline size_t feature_idx(const DirtyFeature& f) {
+    return f.inHand ? hand_idx<perspective>(f.c, f.pt, f.sqOrCount)
+                    : board_idx<perspective>(f.c, f.pt, Square(f.sqOrCount));
+}
+
+
+// feature sets. the index of a feature is made of a bucket, depending only on the position of
+// the perspective's own king, and of the piece feature (board_idx / hand_idx) inside the bucket.
+// a move of the own king changes the bucket, so the accumulator of that perspective is refreshed.
+
+// a piece on a square or the count-th piece of a type in a hand, regardless of the kings
+struct PieceFeatures {
+    static constexpr size_t PIECE_FEATURES = 2 * NUM_SQUARES * NUM_PIECE_TYPES + 2 * 2 * 19;
+    static constexpr size_t NUM_BUCKETS = 1;
+    static constexpr size_t SIZE = PIECE_FEATURES;
+
+    template <Color perspective>
+    static size_t bucket(Square) { return 0; }
+};
+
+
+// halfkp style, the piece features are indexed by the square of the perspective's own king
+// (oriented as board_idx). the kings are kept as piece features, so that the number of active
+// features stays the same (NUM_TOT_PIECES)
+struct HalfKPFeatures {
+    static constexpr size_t PIECE_FEATURES = PieceFeatures::PIECE_FEATURES;
+    static constexpr size_t NUM_BUCKETS = NUM_SQUARES;
+    static constexpr size_t SIZE = NUM_BUCKETS * PIECE_FEATURES;
+
+    template <Color perspective>
+    static size_t bucket(Square ownKing) {
+        return perspective == WHITE ? SQ_99 - ownKing : ownKing;
+    }
+};
+
+
+// true if the move recorded in dp changes the bucket of the perspective
+template <typename FeatureSet>
+inline bool needs_refresh(const DirtyPieces& dp, Color perspective) {
+    if constexpr (FeatureSet::NUM_BUCKETS == 1)
+        return false;
+    // the king is always the first removed feature of a king move
+    return dp.numRemoved && dp.removed[0].pt == KING && dp.removed[0].c == perspective
+        && !dp.removed[0].inHand;
+}
+
+
 } // namespace NNUE
 } // namespace harukashogi
 
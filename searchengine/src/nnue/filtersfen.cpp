@@ -0,0 +1,573 @@
+#include "../position.h"
+#include "../bitboard.h"
+#include "../movegen.h"
+#include "../types.h"
+#include "load.h"
+#include "packed_sfen.h"
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <charconv>
+#include <filesystem>
+#include <algorithm>
+
+using namespace harukashogi;
+namespace fs = std::filesystem;
+
+
+// deduplicates and filters gensfen data (text or .bin files) and writes it as .bin files.
+// the positions are first partitioned by zobrist key into temporary files, so that the
+// copies of a position are all in the same partition, then every partition is sorted by
+// key and only the first position of each key is kept. the partitions are sized so that the
+// ones sorted at the same time fit in the memory budget; a larger partition (the number of
+// partitions is capped, or the keys are not spread evenly) is sorted in runs of the budget
+// that are written back and merged, so the memory stays bounded with any amount of data.
+// the output is in key order, i.e. shuffled.
+
+struct FilterSettings {
+    // positions with a larger absolute score are dropped, 0 keeps all the scores
+    int maxScore = 0;
+    // positions outside of [minPly, maxPly] (game ply, 0 in the initial position) are dropped,
+    // maxPly 0 has no upper bound
+    int minPly = 0;
+    int maxPly = 0;
+    // drop the positions in check and the ones with a winning capture (not quiet, their
+    // score depends on the tactics more than on the features)
+    bool skipChecks = false;
+    bool skipCaptures = false;
+};
+
+
+// record of the temporary partition files
+struct KeyedSample {
+    uint64_t key;
+    NNUE::PackedSample sample;
+};
+
+
+struct FilterStats {
+    std::atomic<uint64_t> read = 0;
+    std::atomic<uint64_t> invalid = 0;
+    std::atomic<uint64_t> filtered = 0;
+    std::atomic<uint64_t> duplicates = 0;
+    std::atomic<uint64_t> written = 0;
+};
+
+
+// average size of a line of the text files, to estimate the number of positions
+constexpr size_t TEXT_LINE_SIZE = 90;
+// the partition files stay open, keep their number below the usual file limit
+constexpr size_t MAX_PARTITIONS = 900;
+// sorted runs merged at the same time by a thread (they are open files with a read buffer),
+// more runs are merged in several passes
+constexpr size_t MAX_MERGE_RUNS = 64;
+// records buffered by each reader thread for each partition before being written
+constexpr size_t MIN_SPILL_RECORDS = 64;
+constexpr size_t MAX_SPILL_RECORDS = 4096;
+
+
+// true if the side to move has a capture winning material
+bool has_winning_capture(Position& pos) {
+    Move moveList[MAX_MOVES];
+    Move* end = pos.checkers() ? generate<EVASIONS>(pos, moveList)
+                               : generate<CAPTURES>(pos, moveList);
+
+    for (Move* m = moveList; m < end; ++m)
+        if (pos.is_capture(*m) && pos.see_ge(*m, 1) && pos.is_legal(*m))
+            return true;
+    return false;
+}
+
+
+bool keep_position(Position& pos, int score, int ply, const FilterSettings& settings) {
+    if (settings.maxScore > 0 && std::abs(score) > settings.maxScore)
+        return false;
+    if (ply < settings.minPly || (settings.maxPly > 0 && ply > settings.maxPly))
+        return false;
+    if (settings.skipChecks && pos.checkers())
+        return false;
+    if (settings.skipCaptures && has_winning_capture(pos))
+        return false;
+    return true;
+}
+
+
+// move count at the end of a SFEN string, 1 if missing
+int sfen_move_count(std::string_view sfen) {
+    while (!sfen.empty() && sfen.back() == ' ')
+        sfen.remove_suffix(1);
+    size_t start = sfen.find_last_of(' ') + 1;
+    int moveCount = 1;
+    std::from_chars(sfen.data() + start, sfen.data() + sfen.size(), moveCount);
+    return moveCount;
+}
+
+
+// temporary files of the partitions, shared by the reader threads
+class PartitionWriter {
+    public:
+        PartitionWriter(const std::string& dir, size_t numPartitions) : locks(numPartitions) {
+            for (size_t i = 0; i < numPartitions; ++i) {
+                paths.push_back(dir + "/" + std::to_string(i) + ".part");
+                files.push_back(std::fopen(paths.back().c_str(), "wb"));
+                if (!files.back())
+                    throw std::runtime_error("Failed to create file: " + paths.back());
+            }
+        }
+        ~PartitionWriter() { close(); }
+
+        void write(size_t partition, const std::vector<KeyedSample>& records) {
+            std::lock_guard<std::mutex> lock(locks[partition]);
+            std::fwrite(records.data(), sizeof(KeyedSample), records.size(), files[partition]);
+        }
+
+        void close() {
+            for (auto& file : files)
+                if (file) std::fclose(file), file = nullptr;
+        }
+
+        size_t size() const { return files.size(); }
+
+    private:
+        std::vector<std::string> paths;
+        std::vector<std::FILE*> files;
+        std::vector<std::mutex> locks;
+};
+
+
+// reads a data file, appending the positions that pass the filters to the partition buffers
+class FileReader {
+    public:
+        FileReader(PartitionWriter& partitions, size_t spillRecords,
+                   const FilterSettings& settings, FilterStats& stats)
+            : partitions(partitions), buffers(partitions.size()), spillRecords(spillRecords),
+              settings(settings), stats(stats) {}
+
+        void read(const std::string& path) {
+            NNUE::MappedFile file(path);
+            if (fs::path(path).extension() == ".bin")
+                read_packed(file, path);
+            else
+                read_text(file);
+        }
+
+        void flush() {
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                if (!buffers[i].empty())
+                    partitions.write(i, buffers[i]);
+                buffers[i].clear();
+            }
+        }
+
+    private:
+        void read_packed(const NNUE::MappedFile& file, const std::string& path) {
+            size_t numRecords = 0;
+            auto records = NNUE::packed_records(file.data(), file.size(), numRecords);
+            if (!records)
+                throw std::runtime_error("Corrupted data file: " + path);
+
+            // corrupt records are skipped as the invalid text lines
+            uint64_t numValid = 0;
+            for (size_t i = 0; i < numRecords; ++i) {
+                if (!NNUE::unpack_sfen(records[i].sfen, pos, records[i].ply + 1)) {
+                    stats.invalid.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                add(records[i]);
+                ++numValid;
+            }
+            stats.read += numValid;
+        }
+
+        void read_text(const NNUE::MappedFile& file) {
+            const char* end = file.data() + file.size();
+            NNUE::SfenBoard board;
+            float score, result;
+            uint64_t numLines = 0;
+
+            for (const char* line = file.data(); line < end; ) {
+                const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', end - line));
+                if (!lineEnd)
+                    lineEnd = end;
+                std::string_view text(line, lineEnd - line);
+                line = lineEnd + 1;
+
+                if (text.find('|') == std::string_view::npos)
+                    continue;
+                // corrupt lines are skipped, they would stop the loader
+                if (!NNUE::parse_data_line(text, board, score, result)) {
+                    stats.invalid.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                // the SFEN move count starts at 1, the samples store the game ply as gensfen
+                int moveCount = sfen_move_count(text.substr(0, text.find('|')));
+                pos.set(board.board, board.hands, board.sideToMove, moveCount);
+
+                // the text result is 1, 0.5 or 0 from the side to move's view
+                NNUE::PackedSample sample{};
+                sample.sfen = NNUE::pack_sfen(pos);
+                sample.score = int16_t(std::clamp(score, float(INT16_MIN), float(INT16_MAX)));
+                sample.ply = uint16_t(std::clamp(moveCount - 1, 0, int(UINT16_MAX)));
+                sample.result = int8_t(std::lround(2 * result - 1));
+                add(sample);
+                ++numLines;
+            }
+            stats.read += numLines;
+        }
+
+        void add(const NNUE::PackedSample& sample) {
+            if (!keep_position(pos, sample.score, sample.ply, settings)) {
+                stats.filtered.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // the high bits of the key select the partition, the whole key is sorted later
+            uint64_t key = pos.get_key();
+            size_t partition = (key >> 32) % buffers.size();
+            buffers[partition].push_back({key, sample});
+            if (buffers[partition].size() >= spillRecords) {
+                partitions.write(partition, buffers[partition]);
+                buffers[partition].clear();
+            }
+        }
+
+        Position pos;
+        PartitionWriter& partitions;
+        std::vector<std::vector<KeyedSample>> buffers;
+        size_t spillRecords;
+        const FilterSettings& settings;
+        FilterStats& stats;
+};
+
+
+// output files of filePositions positions, the last one of each thread can be smaller
+class OutputWriter {
+    public:
+        OutputWriter(const std::string& outDir, size_t filePositions)
+            : outDir(outDir), filePositions(filePositions) {}
+
+        void write(const std::vector<NNUE::PackedSample>& data) {
+            std::string path = outDir + "/" + std::to_string(fileIdx++) + ".bin";
+            NNUE::PackedFileHeader header = NNUE::packed_file_header();
+            std::FILE* file = std::fopen(path.c_str(), "wb");
+            if (!file || std::fwrite(&header, sizeof(header), 1, file) != 1
+                      || std::fwrite(data.data(), sizeof(NNUE::PackedSample), data.size(), file)
+                             != data.size())
+                throw std::runtime_error("Failed to write file: " + path);
+            std::fclose(file);
+        }
+
+        size_t file_positions() const { return filePositions; }
+
+    private:
+        std::string outDir;
+        size_t filePositions;
+        std::atomic<size_t> fileIdx = 0;
+};
+
+
+// order of the records: by key, the ties are broken on the record so that the same copy is
+// kept whatever the order in which the threads wrote the partition
+bool record_less(const KeyedSample& a, const KeyedSample& b) {
+    if (a.key != b.key)
+        return a.key < b.key;
+    return std::memcmp(&a.sample, &b.sample, sizeof(a.sample)) < 0;
+}
+
+
+// sorts the records and keeps the first one of each key
+void sort_unique(std::vector<KeyedSample>& records, FilterStats& stats) {
+    std::sort(records.begin(), records.end(), record_less);
+    auto last = std::unique(records.begin(), records.end(),
+                            [](const KeyedSample& a, const KeyedSample& b) { return a.key == b.key; });
+    stats.duplicates.fetch_add(records.end() - last, std::memory_order_relaxed);
+    records.erase(last, records.end());
+}
+
+
+std::FILE* open_file(const std::string& path, const char* mode) {
+    std::FILE* file = std::fopen(path.c_str(), mode);
+    if (!file)
+        throw std::runtime_error("Failed to open file: " + path);
+    return file;
+}
+
+
+// sorted run of a partition, read back in blocks of bufferRecords records
+class RunReader {
+    public:
+        RunReader(const std::string& path, size_t bufferRecords)
+            : file(open_file(path, "rb")), buffer(bufferRecords) { refill(); }
+        ~RunReader() { std::fclose(file); }
+
+        bool empty() const { return pos == size; }
+        const KeyedSample& top() const { return buffer[pos]; }
+        void pop() {
+            if (++pos == size)
+                refill();
+        }
+
+    private:
+        void refill() {
+            size = std::fread(buffer.data(), sizeof(KeyedSample), buffer.size(), file);
+            pos = 0;
+        }
+
+        std::FILE* file;
+        std::vector<KeyedSample> buffer;
+        size_t pos = 0, size = 0;
+};
+
+
+// merges the sorted runs, calling fn on the first record of each key, and removes them.
+// the read buffers take memoryRecords records
+template <typename Fn>
+void merge_runs(const std::vector<std::string>& runs, size_t memoryRecords, FilterStats& stats,
+                Fn&& fn) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    size_t bufferRecords = std::max<size_t>(memoryRecords / runs.size(), 1);
+    for (const auto& run : runs)
+        readers.push_back(std::make_unique<RunReader>(run, bufferRecords));
+
+    // heap of the readers, with the smallest next record on top
+    auto greater = [&](size_t a, size_t b) { return record_less(readers[b]->top(), readers[a]->top()); };
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < readers.size(); ++i)
+        if (!readers[i]->empty())
+            heap.push_back(i);
+    std::make_heap(heap.begin(), heap.end(), greater);
+
+    bool first = true;
+    uint64_t lastKey = 0;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        RunReader& reader = *readers[heap.back()];
+        const KeyedSample& record = reader.top();
+        if (!first && record.key == lastKey)
+            stats.duplicates.fetch_add(1, std::memory_order_relaxed);
+        else
+            fn(record);
+        first = false;
+        lastKey = record.key;
+
+        reader.pop();
+        if (reader.empty())
+            heap.pop_back();
+        else
+            std::push_heap(heap.begin(), heap.end(), greater);
+    }
+
+    readers.clear();
+    for (const auto& run : runs)
+        fs::remove(run);
+}
+
+
+// sorts a partition by key and moves the first position of each key to data, writing the
+// full output files. a partition of more than memoryRecords records is sorted in runs of
+// memoryRecords records which are then merged
+void dedup_partition(const std::string& path, size_t memoryRecords, OutputWriter& output,
+                     std::vector<NNUE::PackedSample>& data, FilterStats& stats) {
+    auto emit = [&](const KeyedSample& record) {
+        data.push_back(record.sample);
+        if (data.size() == output.file_positions()) {
+            output.write(data);
+            stats.written += data.size();
+            data.clear();
+        }
+    };
+
+    size_t numRecords = fs::file_size(path) / sizeof(KeyedSample);
+    std::vector<std::string> runs;
+    {
+        std::FILE* file = open_file(path, "rb");
+        std::vector<KeyedSample> records;
+        for (size_t start = 0; start < numRecords; start += memoryRecords) {
+            records.resize(std::min(memoryRecords, numRecords - start));
+            if (std::fread(records.data(), sizeof(KeyedSample), records.size(), file) != records.size()) {
+                std::fclose(file);
+                throw std::runtime_error("Failed to read file: " + path);
+            }
+            sort_unique(records, stats);
+
+            if (numRecords <= memoryRecords) {
+                for (const auto& record : records)
+                    emit(record);
+            }
+            else {
+                runs.push_back(path + "." + std::to_string(runs.size()) + ".run");
+                std::FILE* run = open_file(runs.back(), "wb");
+                std::fwrite(records.data(), sizeof(KeyedSample), records.size(), run);
+                std::fclose(run);
+            }
+        }
+        std::fclose(file);
+    }
+    fs::remove(path);
+
+    // merge MAX_MERGE_RUNS runs at a time until the last merge, which writes the output
+    size_t runIdx = runs.size();
+    while (runs.size() > MAX_MERGE_RUNS) {
+        std::vector<std::string> merged;
+        for (size_t i = 0; i < runs.size(); i += MAX_MERGE_RUNS) {
+            std::vector<std::string> group(runs.begin() + i,
+                                           runs.begin() + std::min(i + MAX_MERGE_RUNS, runs.size()));
+            merged.push_back(path + "." + std::to_string(runIdx++) + ".run");
+            std::FILE* run = open_file(merged.back(), "wb");
+            merge_runs(group, memoryRecords, stats, [&](const KeyedSample& record) {
+                std::fwrite(&record, sizeof(KeyedSample), 1, run);
+            });
+            std::fclose(run);
+        }
+        runs = std::move(merged);
+    }
+    if (!runs.empty())
+        merge_runs(runs, memoryRecords, stats, emit);
+}
+
+
+// runs fn(thread, i) for i in [0, n) on numThreads threads, rethrowing the first error
+template <typename Fn>
+void parallel_for(size_t n, int numThreads, Fn&& fn) {
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t] {
+            try {
+                for (size_t i; (i = next++) < n; )
+                    fn(t, i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                next = n;
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+
+void filter_data(const std::string& inDir, const std::string& outDir, size_t filePositions,
+                 int numThreads, size_t memoryMB, const FilterSettings& settings) {
+    Bitboards::init();
+    Position::init();
+
+    std::vector<std::string> files;
+    size_t estimatedPositions = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(inDir)) {
+        std::string ext = entry.path().extension().string();
+        if (!entry.is_regular_file() || (ext != ".txt" && ext != ".bin"))
+            continue;
+        files.push_back(entry.path().string());
+        estimatedPositions += entry.file_size() / (ext == ".bin" ? sizeof(NNUE::PackedSample)
+                                                                 : TEXT_LINE_SIZE);
+    }
+    std::sort(files.begin(), files.end());
+
+    // numThreads partitions are sorted at the same time in the second pass
+    size_t memory = memoryMB << 20;
+    size_t partitionBytes = std::max<size_t>(memory / numThreads, 1);
+    size_t numPartitions = std::clamp<size_t>(
+        estimatedPositions * sizeof(KeyedSample) / partitionBytes + 1, numThreads, MAX_PARTITIONS);
+    size_t memoryRecords = std::max<size_t>(partitionBytes / sizeof(KeyedSample), 1);
+    // the reader buffers take up to a quarter of the memory
+    size_t spillRecords = std::clamp<size_t>(
+        memory / 4 / (numThreads * numPartitions * sizeof(KeyedSample)),
+        MIN_SPILL_RECORDS, MAX_SPILL_RECORDS);
+
+    std::string tmpDir = outDir + "/tmp";
+    fs::create_directories(tmpDir);
+    FilterStats stats;
+
+    std::cout << "Input files:        " << files.size() << std::endl;
+    std::cout << "Partitions:         " << numPartitions << std::endl;
+
+    // 1. filter the positions and partition them by key
+    {
+        PartitionWriter partitions(tmpDir, numPartitions);
+        std::vector<std::unique_ptr<FileReader>> readers;
+        for (int t = 0; t < numThreads; ++t)
+            readers.push_back(std::make_unique<FileReader>(partitions, spillRecords, settings, stats));
+
+        parallel_for(files.size(), numThreads, [&](int t, size_t i) {
+            readers[t]->read(files[i]);
+        });
+        for (auto& reader : readers)
+            reader->flush();
+    }
+    std::cout << "Read positions:     " << stats.read << std::endl;
+    std::cout << "Invalid positions:  " << stats.invalid << std::endl;
+    std::cout << "Filtered positions: " << stats.filtered << std::endl;
+
+    // 2. deduplicate each partition
+    OutputWriter output(outDir, filePositions);
+    std::vector<std::vector<NNUE::PackedSample>> leftovers(numThreads);
+    parallel_for(numPartitions, numThreads, [&](int t, size_t i) {
+        dedup_partition(tmpDir + "/" + std::to_string(i) + ".part", memoryRecords, output,
+                        leftovers[t], stats);
+    });
+    for (auto& data : leftovers) {
+        if (data.empty())
+            continue;
+        output.write(data);
+        stats.written += data.size();
+    }
+    fs::remove_all(tmpDir);
+
+    std::cout << "Duplicates:         " << stats.duplicates << std::endl;
+    std::cout << "Written positions:  " << stats.written << std::endl;
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 11) {
+        std::cerr << "usage: filtersfen inDir outDir [filePositions] [numThreads] [memoryMB] "
+                     "[maxScore] [minPly] [maxPly] [skipChecks] [skipCaptures]" << std::endl;
+        return 1;
+    }
+    std::string inDir = argv[1];
+    std::string outDir = argv[2];
+    size_t filePositions = 1000000;
+    if (argc >= 4) filePositions = std::stoull(argv[3]);
+    int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc >= 5) numThreads = std::stoi(argv[4]);
+    size_t memoryMB = 4096;
+    if (argc >= 6) memoryMB = std::stoull(argv[5]);
+    FilterSettings settings;
+    if (argc >= 7) settings.maxScore = std::stoi(argv[6]);
+    if (argc >= 8) settings.minPly = std::stoi(argv[7]);
+    if (argc >= 9) settings.maxPly = std::stoi(argv[8]);
+    if (argc >= 10) settings.skipChecks = std::stoi(argv[9]) != 0;
+    if (argc >= 11) settings.skipCaptures = std::stoi(argv[10]) != 0;
+
+    if (!fs::exists(outDir))
+        fs::create_directories(outDir);
+
+    std::cout << "Filtering data from " << inDir << " to " << outDir << std::endl;
+    std::cout << "Positions per file: " << filePositions << std::endl;
+    std::cout << "Threads:            " << numThreads << std::endl;
+    std::cout << "Memory (MB):        " << memoryMB << std::endl;
+    std::cout << "Max score:          " << settings.maxScore << std::endl;
+    std::cout << "Ply range:          " << settings.minPly << " - " << settings.maxPly << std::endl;
+    std::cout << "Skip checks:        " << settings.skipChecks << std::endl;
+    std::cout << "Skip captures:      " << settings.skipCaptures << std::endl;
+
+    filter_data(inDir, outDir, filePositions, numThreads, memoryMB, settings);
+
+    return 0;
+}
\ No newline at end of file
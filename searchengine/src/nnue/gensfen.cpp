@@ -3,8 +3,12 @@
 #include "../types.h"
 #include "../movegen.h"
 #include "../misc.h"
+#include "packed_sfen.h"
 
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <fstream>
@@ -45,26 +49,49 @@ class CVManager : public OutputManager {
 };
 
 
-struct DataPoint {
-    std::string sfen;
-    int score;
-    float result;
+// positions are stored packed, with the result from the side to move's point of view
+using DataPoint = NNUE::PackedSample;
+
+
+// search limits of every move, a 100ms search is used if both are 0
+struct GenSettings {
+    uint64_t nodes = 20000;
+    int depth = 0;
+    // the seed of a game is seed + its index, so each game can be reproduced
+    uint64_t seed = std::random_device{}();
 };
 
 
-int play_game(Engine& engine, CVManager& manager, OpeningBook& book, std::vector<DataPoint>& data){
+// adjudication: the game ends when the score stays above RESIGN_SCORE for the same side for
+// RESIGN_PLIES plies, when it stays within DRAW_SCORE of 0 for DRAW_PLIES plies after
+// DRAW_MIN_PLY, or (as a draw) after MAX_GAME_PLY plies
+constexpr int RESIGN_SCORE = 8000;
+constexpr int RESIGN_PLIES = 6;
+constexpr int DRAW_SCORE   = 100;
+constexpr int DRAW_PLIES   = 20;
+constexpr int DRAW_MIN_PLY = 200;
+constexpr int MAX_GAME_PLY = 400;
+
+
+// plays a game and appends its positions to data. returns the number of positions added,
+// the game is dropped (0 positions) if stop is set before it ends
+int play_game(Engine& engine, CVManager& manager, const OpeningBook& book,
+              const GenSettings& settings, std::mt19937& rng, const std::atomic<bool>& stop,
+              std::vector<DataPoint>& data){
     size_t gameStartIdx = data.size();
 
-    std::mt19937 rng = std::mt19937(std::random_device{}());
     Position pos;
     pos.set();
 
     Move moveList[MAX_MOVES];
     Move move, *end;
     int numMoves = 0, score;
+    int resignPlies = 0, drawPlies = 0;
+    Color leader = NO_COLOR, winner = NO_COLOR;
+    bool adjudicated = false;
 
     // start the game with a random last move from the opening book
-    while (!pos.is_game_over() && (move = book.sample_move(pos.get_key())) != Move::null()) {
+    while (!pos.is_game_over() && (move = book.sample_move(pos.get_key(), rng)) != Move::null()) {
         pos.make_move(move);
         numMoves++;
 
@@ -84,11 +111,19 @@ int play_game(Engine& engine, CVManager& manager, OpeningBook& book, std::vector
 
     // main generation loop
     SearchLimits limits;
-    while (!pos.is_game_over() && numMoves < 1000) {
-        // search for 100ms and get the best move and score
+    while (!pos.is_game_over() && numMoves < MAX_GAME_PLY) {
+        if (stop.load(std::memory_order_relaxed)) {
+            data.resize(gameStartIdx);
+            return 0;
+        }
+
+        // search and get the best move and score
         engine.set_position(pos.sfen());
         limits = SearchLimits();
-        limits.moveTime = chr::milliseconds(100);
+        limits.nodes = settings.nodes;
+        limits.depth = settings.depth;
+        if (limits.nodes == 0 && limits.depth == 0)
+            limits.moveTime = chr::milliseconds(100);
         engine.go(limits);
         move = manager.wait_for_best_move();
         score = manager.get_score();
@@ -108,9 +143,33 @@ int play_game(Engine& engine, CVManager& manager, OpeningBook& book, std::vector
         // filter out checks and positions where a capture is the best move
         // if a capture is the best move, we are likely to be in an unstable position
         if (!pos.checkers() && !pos.is_capture(move)) {
-            data.push_back({pos.sfen(), score, pos.side_to_move() == BLACK ? 0.0f : 1.0f});
+            DataPoint point = {};
+            point.sfen = NNUE::pack_sfen(pos);
+            point.score = int16_t(score);
+            point.ply = uint16_t(pos.get_move_count());
+            data.push_back(point);
         }
         
+        // the score is from the side to move's point of view
+        if (std::abs(score) >= RESIGN_SCORE) {
+            Color side = score > 0 ? pos.side_to_move() : ~pos.side_to_move();
+            resignPlies = side == leader ? resignPlies + 1 : 1;
+            leader = side;
+        }
+        else
+            resignPlies = 0;
+        drawPlies = std::abs(score) <= DRAW_SCORE ? drawPlies + 1 : 0;
+
+        if (resignPlies >= RESIGN_PLIES) {
+            winner = leader;
+            adjudicated = true;
+            break;
+        }
+        if (numMoves >= DRAW_MIN_PLY && drawPlies >= DRAW_PLIES) {
+            adjudicated = true;
+            break;
+        }
+
         pos.make_move(move);
         numMoves++;
     }
@@ -119,32 +178,28 @@ int play_game(Engine& engine, CVManager& manager, OpeningBook& book, std::vector
     if (data.size() == gameStartIdx)
         return 0;
 
-    Color winner = pos.get_winner();
+    if (!adjudicated)
+        winner = pos.get_winner();
 
     for (size_t i = gameStartIdx; i < data.size(); i++) {
-        if (winner == NO_COLOR) {
-            data[i].result = 0.5f;
-        }
-        else if ((data[i].result == 0 && winner == BLACK) || 
-                 (data[i].result == 1 && winner == WHITE)) {
-            data[i].result = 1.0f;
-        }
-        else {
-            data[i].result = 0.0f;
-        }
+        if (winner == NO_COLOR)
+            data[i].result = 0;
+        else
+            data[i].result = data[i].sfen.side_to_move() == winner ? 1 : -1;
     }
 
     return data.size() - gameStartIdx;
 }
 
 
-void write_file(const std::string& filePath, std::vector<DataPoint>& data, int numPositions) {
-    // write the data to a file
-    std::ofstream file(filePath);
+void write_file(const std::string& filePath, std::vector<DataPoint>& data, size_t numPositions) {
+    // write the header and the records to a file in a single block
+    std::ofstream file(filePath, std::ios::binary);
     assert(file.is_open());
-    numPositions = std::min(numPositions, int(data.size()));
-    for (size_t i=0; i<numPositions; i++)
-        file << data[i].sfen << " | " << data[i].score << " | " << data[i].result << std::endl;
+    NNUE::PackedFileHeader header = NNUE::packed_file_header();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    numPositions = std::min(numPositions, data.size());
+    file.write(reinterpret_cast<const char*>(data.data()), numPositions * sizeof(DataPoint));
     file.close();
 
     // remove the data from the vector
@@ -152,37 +207,138 @@ void write_file(const std::string& filePath, std::vector<DataPoint>& data, int n
 }
 
 
-void generate_data(const std::string& outDir, int totalPositions, int filePositions) {
-    init();
+// lock-free multi-producer single-consumer queue of finished games.
+// the game threads push onto an intrusive stack, the writer takes the whole stack at once
+// (so there is no ABA problem) and reverses it to get the games in push order.
+class GameQueue {
+    public:
+        ~GameQueue() { pop_all(); }
+
+        void push(std::vector<DataPoint>&& game) {
+            Node* node = new Node{std::move(game), head.load(std::memory_order_relaxed)};
+            while (!head.compare_exchange_weak(node->next, node,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+        }
+
+        // appends all the queued positions to data, returns false if the queue was empty
+        bool pop_all(std::vector<DataPoint>* data = nullptr) {
+            Node* node = head.exchange(nullptr, std::memory_order_acquire);
+            if (node == nullptr)
+                return false;
+
+            Node* reversed = nullptr;
+            while (node != nullptr) {
+                Node* next = node->next;
+                node->next = reversed;
+                reversed = node;
+                node = next;
+            }
+
+            while (reversed != nullptr) {
+                Node* next = reversed->next;
+                if (data)
+                    std::move(reversed->game.begin(), reversed->game.end(), std::back_inserter(*data));
+                delete reversed;
+                reversed = next;
+            }
+            return true;
+        }
+
+    private:
+        struct Node {
+            std::vector<DataPoint> game;
+            Node* next;
+        };
+
+        std::atomic<Node*> head{nullptr};
+};
+
+
+// per-game search state: every game thread has its own engine (transposition table, search
+// stacks, accumulators) while the network and the opening book are shared read-only
+struct GameWorker {
+    GameWorker(std::shared_ptr<NNUE::NNUE> nnue, int hashSize) : engine(manager, nnue) {
+        engine.resize_threadpool(1);
+        engine.resize_tt(hashSize);
+        engine.set_own_book(false);
+    }
+
     CVManager manager;
-    Engine engine(manager);
-    engine.resize_threadpool(1);
-    engine.resize_tt(200);
-    engine.set_own_book(false);
-    OpeningBook book;
+    Engine engine;
+    std::thread thread;
+};
 
-    std::vector<DataPoint> data;
 
-    int generatedPositions = 0;
+void generate_data(const std::string& outDir, size_t totalPositions, size_t filePositions,
+                   int numThreads, int hashSize, const GenSettings& settings) {
+    init();
+    auto nnue = std::make_shared<NNUE::NNUE>();
+    const OpeningBook book;
+    GameQueue queue;
+    std::atomic<bool> stop = false;
+    std::atomic<uint64_t> gameIdx = 0;
+
+    // the engines are created here since init() is not thread safe
+    std::vector<std::unique_ptr<GameWorker>> workers;
+    for (int i = 0; i < numThreads; i++)
+        workers.push_back(std::make_unique<GameWorker>(nnue, hashSize));
+
+    for (auto& worker : workers) {
+        worker->thread = std::thread([&, w = worker.get()] {
+            while (!stop.load(std::memory_order_relaxed)) {
+                // every game starts from a clean search state so that it only depends on its seed
+                std::mt19937 rng(settings.seed + gameIdx++);
+                w->engine.new_game();
+                w->engine.clear_tt();
+
+                std::vector<DataPoint> game;
+                if (play_game(w->engine, w->manager, book, settings, rng, stop, game) > 0)
+                    queue.push(std::move(game));
+            }
+        });
+    }
+
+    // writer: collects the finished games and writes them in files of filePositions positions
+    std::vector<DataPoint> data;
+    size_t writtenPositions = 0;
     int fileIdx = 0;
-    while (generatedPositions < totalPositions) {
-        generatedPositions += play_game(engine, manager, book, data);
+    while (writtenPositions < totalPositions) {
+        if (!queue.pop_all(&data)) {
+            std::this_thread::sleep_for(chr::milliseconds(10));
+            continue;
+        }
 
-        if (data.size() >= filePositions) {
+        while (data.size() >= filePositions && writtenPositions < totalPositions) {
             std::cout << "Writing file " << fileIdx << std::endl;
-            write_file(outDir + "/" + std::to_string(fileIdx++) + ".txt", data, filePositions);
+            write_file(outDir + "/" + std::to_string(fileIdx++) + ".bin", data, filePositions);
+            writtenPositions += filePositions;
         }
     }
+
+    stop = true;
+    for (auto& worker : workers)
+        worker->thread.join();
 }
 
 
 int main(int argc, char* argv[]) {
-    assert(argc >= 2 && argc <= 4);
+    assert(argc >= 2 && argc <= 9);
     std::string outDir = argv[1];
-    int totalPositions = 1000000;
-    if (argc >= 3) totalPositions = std::stoi(argv[2]);
-    int filePositions = 1000;
-    if (argc >= 4) filePositions = std::stoi(argv[3]);
+    size_t totalPositions = 1000000;
+    if (argc >= 3) totalPositions = std::stoull(argv[2]);
+    size_t filePositions = 1000;
+    if (argc >= 4) filePositions = std::stoull(argv[3]);
+    int numThreads = 1;
+    if (argc >= 5) numThreads = std::stoi(argv[4]);
+    // transposition table size of each game in MB. the table is cleared before every game, a
+    // few MB (about 400k entries for 4 MB) hold the whole game with the default 20000 node searches
+    int hashSize = 4;
+    if (argc >= 6) hashSize = std::stoi(argv[5]);
+    GenSettings settings;
+    if (argc >= 7) settings.nodes = std::stoull(argv[6]);
+    if (argc >= 8) settings.depth = std::stoi(argv[7]);
+    if (argc >= 9) settings.seed = std::stoull(argv[8]);
 
     if (!std::filesystem::exists(outDir))
         std::filesystem::create_directories(outDir);
@@ -190,8 +346,13 @@ int main(int argc, char* argv[]) {
     std::cout << "Generating data in " << outDir << std::endl;
     std::cout << "Total positions:    " << totalPositions << std::endl;
     std::cout << "Positions per file: " << filePositions << std::endl;
+    std::cout << "Concurrent games:   " << numThreads << std::endl;
+    std::cout << "Hash per game (MB): " << hashSize << std::endl;
+    std::cout << "Nodes per move:     " << settings.nodes << std::endl;
+    std::cout << "Depth per move:     " << settings.depth << std::endl;
+    std::cout << "Seed:               " << settings.seed << std::endl;
 
-    generate_data(outDir, totalPositions, filePositions);
+    generate_data(outDir, totalPositions, filePositions, numThreads, hashSize, settings);
 
     return 0;
 };
\ No newline at end of file
@@ -5,18 +5,43 @@
 #include<cstdint>
 #include<algorithm>
 
+#include "../simd.h"
+
 namespace harukashogi {
 namespace NNUE {
 
 
+// clipped relu, clamps the int16 accumulator values to [0, 127] and converts them to int8
 template <size_t SIZE>
 void crelu16(const int16_t* input, int8_t* output) {
+#if defined(USE_SIMD)
+    if constexpr (SIZE % SIMD_WIDTH == 0) {
+        constexpr size_t LANES = SIMD_WIDTH / sizeof(int16_t);
+        for (size_t i = 0; i < SIZE; i += SIMD_WIDTH) {
+            vec_t packed = vec_packus_16(vec_load(input + i), vec_load(input + i + LANES));
+            vec_store(output + i, packed);
+        }
+        return;
+    }
+#endif
+
     for (size_t i = 0; i < SIZE; ++i) {
         output[i] = std::clamp<int16_t>(input[i], 0, 127);
     }
 }
 
 
+// clipped relu between two dense layers, the int32 outputs are scaled back by the weights
+// quantization (2^SHIFT), clamped to [0, 127] and converted to int8.
+// the layers are small, the loop is left to the compiler vectorizer
+template <size_t SIZE, int SHIFT>
+void crelu32(const int32_t* input, int8_t* output) {
+    for (size_t i = 0; i < SIZE; ++i) {
+        output[i] = std::clamp<int32_t>(input[i] >> SHIFT, 0, 127);
+    }
+}
+
+
 } // namespace NNUE
 } // namespace harukashogi
 
@@ -4,9 +4,13 @@
 #include <cstdint>
 #include <cstddef>
 #include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <bit>
 
 #include "../features.h"
 #include "../accumulator.h"
+#include "../simd.h"
 #include "../../position.h"
 #include "../../types.h"
 
@@ -14,72 +18,259 @@ namespace harukashogi {
 namespace NNUE {
 
 
-template <size_t N, size_t M>
+// list of feature indexes to add to (or remove from) an accumulator
+template <size_t CAPACITY>
+struct FeatureList {
+    size_t idx[CAPACITY];
+    size_t size = 0;
+
+    void push(size_t i) { assert(size < CAPACITY); idx[size++] = i; }
+};
+
+// features changed by a move for one perspective (see DirtyPieces)
+using DeltaList = FeatureList<2>;
+// max number of active features in a position (every piece is either on the board or in a hand)
+using ActiveList = FeatureList<NUM_TOT_PIECES>;
+
+
+// refresh cache (finny table): for each bucket and perspective the last accumulator computed
+// from scratch and the set of piece features (inside the bucket) it was built from.
+// a refresh only applies the difference between the cached features and the new ones
+template <typename F, size_t M>
+struct RefreshCache {
+    struct Entry {
+        alignas(64) int16_t acc[M];
+        uint64_t active[(F::PIECE_FEATURES + 63) / 64];
+        bool valid = false;
+    };
+
+    Entry entries[F::NUM_BUCKETS][NUM_COLORS];
+
+    void clear() {
+        for (auto& bucket : entries)
+            bucket[BLACK].valid = bucket[WHITE].valid = false;
+    }
+};
+
+
+// F is the feature set (see features.h), M the accumulator size
+template <typename F, size_t M>
 class FeatureTransformer {
     public:
+        static constexpr size_t N = F::SIZE;
+        // size of the weights and biases in the network file
+        static constexpr size_t FILE_SIZE = sizeof(int16_t) * (N + 1) * M;
+
         FeatureTransformer() {}
 
+        // bucket of the perspective in the position
+        template <Color perspective>
+        static size_t bucket(const Position& pos) {
+            return F::template bucket<perspective>(pos.king_square(perspective));
+        }
+
         // compute the accumulator from scratch
         void forward(const Position& pos, Accumulator<M>& acc) const;
 
-        // update the accumulator incrementally
+        // compute one perspective of the accumulator from the refresh cache, applying only the
+        // features that changed since the cached one (same result as forward)
+        template <Color perspective>
+        void refresh(const Position& pos, Accumulator<M>& acc, RefreshCache<F, M>& cache) const;
+        void refresh(const Position& pos, Accumulator<M>& acc, RefreshCache<F, M>& cache) const {
+            refresh<BLACK>(pos, acc, cache);
+            refresh<WHITE>(pos, acc, cache);
+        }
+
+        // features changed by the move, computed before the move is made
+        static DirtyPieces dirty_pieces(const Position& pos, Move m);
+
+        // update one perspective of the accumulator incrementally, applying the changed features
+        // to the old one. the bucket must be the same in both positions (see needs_refresh)
+        template <Color perspective>
         void incremental_update(
-            const Position& pos,
-            Move m,
+            const DirtyPieces& dp,
+            size_t bucket,
             const Accumulator<M>& oldAcc,
             Accumulator<M>& newAcc
         ) const;
 
-        // set the weights and biases
+        // set the biases and point the weights to the network data, which is not copied and
+        // must outlive the feature transformer (the embedded network or the mapped file)
         const unsigned char* set_weights(const unsigned char* weights_start);
 
     private:
-        int16_t weights[N][M];
-        int16_t biases[M];
+        // collect the active piece features (without the bucket) of the position for the perspective
+        template <Color perspective>
+        static void active_features(const Position& pos, ActiveList& active);
+
+        // out = in + sum of the added weight rows - sum of the removed weight rows.
+        // all the changes are applied in a single pass, keeping a slice of the accumulator in the
+        // vector registers (out can be the same as in)
+        template <size_t A, size_t R>
+        void apply(const int16_t* in, int16_t* out,
+                   const FeatureList<A>& added, const FeatureList<R>& removed) const;
+
+        // weights of the i-th feature
+        const int16_t* row(size_t i) const { return weights + i * M; }
+
+        // N x M weights, row major. they are read in place, so the processes using the same
+        // network file share its pages
+        const int16_t* weights = nullptr;
+        alignas(64) int16_t biases[M];
 };
 
 
-template <size_t N, size_t M>
-void FeatureTransformer<N, M>::forward(const Position& pos, Accumulator<M>& acc) const {
-    // initialize the accumulator with the biases
-    std::memcpy(acc[BLACK], biases, sizeof(biases));
-    std::memcpy(acc[WHITE], biases, sizeof(biases));
+template <typename F, size_t M>
+template <size_t A, size_t R>
+void FeatureTransformer<F, M>::apply(const int16_t* in, int16_t* out,
+                                     const FeatureList<A>& added,
+                                     const FeatureList<R>& removed) const {
+#if defined(USE_SIMD)
+    if constexpr (M * sizeof(int16_t) % SIMD_WIDTH == 0) {
+        constexpr size_t LANES = SIMD_WIDTH / sizeof(int16_t);
+        // number of registers in a slice, the whole accumulator if it fits
+        constexpr size_t REGS = std::min(M / LANES, NUM_REGISTERS);
+        static_assert(M % (REGS * LANES) == 0);
+
+        for (size_t offset = 0; offset < M; offset += REGS * LANES) {
+            vec_t regs[REGS];
+            for (size_t r = 0; r < REGS; ++r)
+                regs[r] = vec_load(in + offset + r * LANES);
+
+            for (size_t i = 0; i < removed.size; ++i) {
+                const int16_t* w = row(removed.idx[i]) + offset;
+                for (size_t r = 0; r < REGS; ++r)
+                    regs[r] = vec_sub_16(regs[r], vec_load(w + r * LANES));
+            }
+            for (size_t i = 0; i < added.size; ++i) {
+                const int16_t* w = row(added.idx[i]) + offset;
+                for (size_t r = 0; r < REGS; ++r)
+                    regs[r] = vec_add_16(regs[r], vec_load(w + r * LANES));
+            }
+
+            for (size_t r = 0; r < REGS; ++r)
+                vec_store(out + offset + r * LANES, regs[r]);
+        }
+        return;
+    }
+#endif
+
+    // scalar fallback
+    int16_t tmp[M];
+    std::memcpy(tmp, in, sizeof(tmp));
+    for (size_t i = 0; i < removed.size; ++i)
+        for (size_t j = 0; j < M; ++j)
+            tmp[j] -= row(removed.idx[i])[j];
+    for (size_t i = 0; i < added.size; ++i)
+        for (size_t j = 0; j < M; ++j)
+            tmp[j] += row(added.idx[i])[j];
+    std::memcpy(out, tmp, sizeof(tmp));
+}
+
 
-    // for every board piece present add the 
+template <typename F, size_t M>
+template <Color perspective>
+void FeatureTransformer<F, M>::active_features(const Position& pos, ActiveList& active) {
+    // for every board piece present add the corresponding feature
     for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq) {
         if (pos.piece(sq) != NO_PIECE) {
             PieceType pt = type_of(pos.piece(sq));
             Color c = color_of(pos.piece(sq));
-            for (int i = 0; i < M; ++i) {
-                acc[BLACK][i] += weights[board_idx<BLACK>(c, pt, sq)][i];
-                acc[WHITE][i] += weights[board_idx<WHITE>(c, pt, sq)][i];
-            }
+            active.push(board_idx<perspective>(c, pt, sq));
         }
     }
 
-    // for every hand piece add the corresponding feature weights
+    // for every hand piece add the corresponding feature
     for (Color c = BLACK; c < NUM_COLORS; ++c) {
         for (PieceType pt = GOLD; pt < NUM_UNPROMOTED_PIECE_TYPES; ++pt) {
-            for (int count = 0; count < pos.hand_count(c, pt); ++count) {
-                for (int i = 0; i < M; ++i) {
-                    acc[BLACK][i] += weights[hand_idx<BLACK>(c, pt, count)][i];
-                    acc[WHITE][i] += weights[hand_idx<WHITE>(c, pt, count)][i];
-                }
-            }
+            for (int count = 0; count < pos.hand_count(c, pt); ++count)
+                active.push(hand_idx<perspective>(c, pt, count));
         }
     }
 }
 
 
-template <size_t N, size_t M>
-void FeatureTransformer<N, M>::incremental_update(
+template <typename F, size_t M>
+void FeatureTransformer<F, M>::forward(const Position& pos, Accumulator<M>& acc) const {
+    ActiveList active[NUM_COLORS];
+    DeltaList none;
+
+    active_features<BLACK>(pos, active[BLACK]);
+    active_features<WHITE>(pos, active[WHITE]);
+
+    // move the piece features to the bucket of each perspective
+    size_t offset[NUM_COLORS] = {
+        bucket<BLACK>(pos) * F::PIECE_FEATURES,
+        bucket<WHITE>(pos) * F::PIECE_FEATURES
+    };
+    for (Color p = BLACK; p < NUM_COLORS; ++p)
+        for (size_t i = 0; i < active[p].size; ++i)
+            active[p].idx[i] += offset[p];
+
+    // start from the biases and sum the weights of the active features
+    apply(biases, acc[BLACK], active[BLACK], none);
+    apply(biases, acc[WHITE], active[WHITE], none);
+}
+
+
+template <typename F, size_t M>
+template <Color perspective>
+void FeatureTransformer<F, M>::refresh(
     const Position& pos,
-    Move m,
-    const Accumulator<M>& oldAcc,
-    Accumulator<M>& newAcc
+    Accumulator<M>& acc,
+    RefreshCache<F, M>& cache
 ) const {
-    // copy the old accumulator to the new accumulator
-    newAcc = oldAcc;
+    constexpr size_t WORDS = (F::PIECE_FEATURES + 63) / 64;
+
+    ActiveList active;
+    active_features<perspective>(pos, active);
+
+    size_t b = bucket<perspective>(pos);
+    size_t offset = b * F::PIECE_FEATURES;
+    typename RefreshCache<F, M>::Entry& entry = cache.entries[b][perspective];
+
+    uint64_t newActive[WORDS] = {};
+    for (size_t i = 0; i < active.size; ++i) {
+        newActive[active.idx[i] / 64] |= uint64_t(1) << (active.idx[i] % 64);
+        active.idx[i] += offset;
+    }
+
+    // the features set in only one of the two sets are the ones to add or remove
+    ActiveList added, removed;
+    bool fromScratch = !entry.valid;
+
+    for (size_t w = 0; w < WORDS && !fromScratch; ++w) {
+        uint64_t diff = newActive[w] ^ entry.active[w];
+        while (diff) {
+            size_t idx = w * 64 + std::countr_zero(diff);
+            diff &= diff - 1;
+
+            ActiveList& list = (newActive[w] >> (idx % 64)) & 1 ? added : removed;
+            // an unrelated position, it is cheaper to start from the biases
+            if (list.size == NUM_TOT_PIECES || added.size + removed.size >= active.size) {
+                fromScratch = true;
+                break;
+            }
+            list.push(idx + offset);
+        }
+    }
+
+    if (fromScratch) {
+        DeltaList none;
+        apply(biases, entry.acc, active, none);
+    }
+    else
+        apply(entry.acc, entry.acc, added, removed);
+
+    std::memcpy(entry.active, newActive, sizeof(newActive));
+    entry.valid = true;
+    std::memcpy(acc[perspective], entry.acc, sizeof(entry.acc));
+}
+
+
+template <typename F, size_t M>
+DirtyPieces FeatureTransformer<F, M>::dirty_pieces(const Position& pos, Move m) {
+    DirtyPieces dp;
 
     Color stm = pos.side_to_move();
     Square to = m.to();
@@ -87,58 +278,64 @@ void FeatureTransformer<N, M>::incremental_update(
     if (m.is_drop()) {
         PieceType pt = m.dropped();
         // add the dropped piece to the board
-        for (int i = 0; i < M; ++i) {
-            newAcc[BLACK][i] += weights[board_idx<BLACK>(stm, pt, to)][i];
-            newAcc[WHITE][i] += weights[board_idx<WHITE>(stm, pt, to)][i];
-        }
+        dp.add({stm, pt, false, to});
         // remove the dropped piece from the hand
-        for (int i = 0; i < M; ++i) {
-            newAcc[BLACK][i] -= weights[hand_idx<BLACK>(stm, pt, pos.hand_count(stm, pt)-1)][i];
-            newAcc[WHITE][i] -= weights[hand_idx<WHITE>(stm, pt, pos.hand_count(stm, pt)-1)][i];
-        }
+        dp.remove({stm, pt, true, uint8_t(pos.hand_count(stm, pt)-1)});
     }
 
     else {
         Square from = m.from();
         PieceType pt = type_of(pos.piece(from));
         // remove the piece from the board
-        for (int i = 0; i < M; ++i) {
-            newAcc[BLACK][i] -= weights[board_idx<BLACK>(stm, pt, from)][i];
-            newAcc[WHITE][i] -= weights[board_idx<WHITE>(stm, pt, from)][i];
-        }
+        dp.remove({stm, pt, false, from});
         // add the piece to the board
         if (m.is_promotion())
             pt = promote(pt);
-        for (int i = 0; i < M; ++i) {
-            newAcc[BLACK][i] += weights[board_idx<BLACK>(stm, pt, to)][i];
-            newAcc[WHITE][i] += weights[board_idx<WHITE>(stm, pt, to)][i];
-        }
+        dp.add({stm, pt, false, to});
 
         // if the move is a capture, remove the captured piece from the board and add it to the hand
         if (pos.is_capture(m)) {
             // remove the captured piece from the board
             PieceType capturedPT = type_of(pos.piece(m.to()));
-            for (int i = 0; i < M; ++i) {
-                newAcc[BLACK][i] -= weights[board_idx<BLACK>(~stm, capturedPT, m.to())][i];
-                newAcc[WHITE][i] -= weights[board_idx<WHITE>(~stm, capturedPT, m.to())][i];
-            }
+            dp.remove({~stm, capturedPT, false, to});
             // add the captured piece to the hand
             capturedPT = unpromoted_type(capturedPT);
-            int count = pos.hand_count(stm, capturedPT);
-            for (int i = 0; i < M; ++i) {
-                newAcc[BLACK][i] += weights[hand_idx<BLACK>(stm, capturedPT, count)][i];
-                newAcc[WHITE][i] += weights[hand_idx<WHITE>(stm, capturedPT, count)][i];
-            }
+            dp.add({stm, capturedPT, true, uint8_t(pos.hand_count(stm, capturedPT))});
         }
     }
+
+    return dp;
+}
+
+
+template <typename F, size_t M>
+template <Color perspective>
+void FeatureTransformer<F, M>::incremental_update(
+    const DirtyPieces& dp,
+    size_t bucket,
+    const Accumulator<M>& oldAcc,
+    Accumulator<M>& newAcc
+) const {
+    // compute the indexes of the changed features, then apply them to the old accumulator
+    // in one pass
+    DeltaList added, removed;
+    size_t offset = bucket * F::PIECE_FEATURES;
+
+    for (int i = 0; i < dp.numAdded; ++i)
+        added.push(offset + feature_idx<perspective>(dp.added[i]));
+    for (int i = 0; i < dp.numRemoved; ++i)
+        removed.push(offset + feature_idx<perspective>(dp.removed[i]));
+
+    apply(oldAcc[perspective], newAcc[perspective], added, removed);
 }
 
 
-template <size_t N, size_t M>
-const unsigned char* FeatureTransformer<N, M>::set_weights(const unsigned char* weightsStart) {
-    std::memcpy(this->weights, weightsStart, sizeof(this->weights));
-    std::memcpy(this->biases, weightsStart + sizeof(weights), sizeof(this->biases));
-    return weightsStart + sizeof(weights) + sizeof(biases);
+template <typename F, size_t M>
+const unsigned char* FeatureTransformer<F, M>::set_weights(const unsigned char* weightsStart) {
+    constexpr size_t WEIGHTS_SIZE = sizeof(int16_t) * N * M;
+    weights = reinterpret_cast<const int16_t*>(weightsStart);
+    std::memcpy(biases, weightsStart + WEIGHTS_SIZE, sizeof(biases));
+    return weightsStart + WEIGHTS_SIZE + sizeof(biases);
 }
 
 
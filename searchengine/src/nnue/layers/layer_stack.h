@@ -0,0 +1,83 @@
+#ifndef LAYER_STACK_H
+#define LAYER_STACK_H
+
+#include<cstddef>
+#include<cstdint>
+
+#include "crelu.h"
+
+namespace harukashogi {
+namespace NNUE {
+
+
+// the dense layers following the feature transformer, composed at compile time.
+// every layer but the last one is followed by a clipped relu, e.g.
+// LayerStack<SHIFT, Linear<64, 16>, Linear<16, 1>> is Linear -> CReLU -> Linear.
+// SHIFT is the log2 of the weights quantization, used to scale back the hidden outputs.
+template <int SHIFT, typename... Layers>
+class LayerStack;
+
+
+// last layer, its int32 outputs are the outputs of the network
+template <int SHIFT, typename Last>
+class LayerStack<SHIFT, Last> {
+    public:
+        static constexpr size_t INPUT_SIZE = Last::INPUT_SIZE;
+        static constexpr size_t OUTPUT_SIZE = Last::OUTPUT_SIZE;
+        static constexpr size_t FILE_SIZE = Last::FILE_SIZE;
+
+        void forward(const int8_t* input, int32_t* output) const { layer.forward(input, output); }
+
+        const unsigned char* set_weights(const unsigned char* weightsStart) {
+            return layer.set_weights(weightsStart);
+        }
+
+        // hash of the layer sizes, stored in the network files to check the architecture
+        static constexpr uint32_t hash(uint32_t h = 2166136261u) {
+            return ((h ^ uint32_t(INPUT_SIZE)) * 16777619u ^ uint32_t(OUTPUT_SIZE)) * 16777619u;
+        }
+
+    private:
+        Last layer;
+};
+
+
+template <int SHIFT, typename First, typename... Rest>
+class LayerStack<SHIFT, First, Rest...> {
+    using Next = LayerStack<SHIFT, Rest...>;
+    static_assert(First::OUTPUT_SIZE == Next::INPUT_SIZE, "layer sizes don't match");
+
+    public:
+        static constexpr size_t INPUT_SIZE = First::INPUT_SIZE;
+        static constexpr size_t OUTPUT_SIZE = Next::OUTPUT_SIZE;
+        static constexpr size_t FILE_SIZE = First::FILE_SIZE + Next::FILE_SIZE;
+
+        void forward(const int8_t* input, int32_t* output) const {
+            alignas(64) int32_t hidden[First::OUTPUT_SIZE];
+            alignas(64) int8_t activated[First::OUTPUT_SIZE];
+
+            layer.forward(input, hidden);
+            crelu32<First::OUTPUT_SIZE, SHIFT>(hidden, activated);
+            next.forward(activated, output);
+        }
+
+        // the layers are stored one after the other in the network file
+        const unsigned char* set_weights(const unsigned char* weightsStart) {
+            return next.set_weights(layer.set_weights(weightsStart));
+        }
+
+        static constexpr uint32_t hash(uint32_t h = 2166136261u) {
+            h = ((h ^ uint32_t(INPUT_SIZE)) * 16777619u ^ uint32_t(First::OUTPUT_SIZE)) * 16777619u;
+            return Next::hash(h);
+        }
+
+    private:
+        First layer;
+        Next next;
+};
+
+
+} // namespace NNUE
+} // namespace harukashogi
+
+#endif // LAYER_STACK_H
\ No newline at end of file
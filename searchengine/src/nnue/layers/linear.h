@@ -4,32 +4,132 @@
 #include<cstddef>
 #include<cstdint>
 #include<cstring>
+#include<bit>
+
+#include "../simd.h"
 
 namespace harukashogi {
 namespace NNUE {
 
 
+// fully connected layer with int8 inputs and weights, and int32 biases and outputs.
+// the inputs come from a clipped relu, so they are in [0, 127].
 template <size_t IN_SIZE, size_t OUT_SIZE>
 class Linear {
     public:
+        static constexpr size_t INPUT_SIZE = IN_SIZE;
+        static constexpr size_t OUTPUT_SIZE = OUT_SIZE;
+        // size of the weights and biases in the network file
+        static constexpr size_t FILE_SIZE = sizeof(int8_t) * OUT_SIZE * IN_SIZE
+                                          + sizeof(int32_t) * OUT_SIZE;
+
         Linear() {};
 
         void forward(const int8_t* input, int32_t* output) const;
 
+        // the weights in the file are stored as [OUT_SIZE][IN_SIZE] (as in pytorch),
+        // they are permuted to the layout used by forward.
         const unsigned char* set_weights(const unsigned char* weights_start);
 
     private:
-        int8_t weights[IN_SIZE][OUT_SIZE];
-        int32_t bias[OUT_SIZE];
+        // the weights layout depends on the output size:
+        // - wide layers (OUT_SIZE a multiple of the int32 lanes of a vector) are computed one
+        //   block of 4 inputs at a time for all the outputs. The weights are stored in blocks of
+        //   [IN_SIZE/4][OUT_SIZE][4], so that a block of 4 inputs is multiplied with contiguous
+        //   vectors of weights.
+        // - narrow layers (e.g. the single output) are computed as a dot product for each output,
+        //   the weights are stored as [OUT_SIZE][IN_SIZE].
+#if defined(USE_SIMD)
+        static constexpr bool BLOCKED = OUT_SIZE % (SIMD_WIDTH / 4) == 0 && IN_SIZE % 4 == 0;
+        static constexpr bool ROWS = !BLOCKED && IN_SIZE % SIMD_WIDTH == 0;
+#else
+        static constexpr bool BLOCKED = false;
+        static constexpr bool ROWS = false;
+#endif
+
+        // the inputs come from a clipped relu, so many blocks of 4 are zero. with SPARSE the
+        // non zero blocks are found first (with a mask over a vector of blocks) and only their
+        // weights are accumulated.
+        // only the blocked layout has it: none of the shipped nets use it (their single output
+        // heads take the ROWS path, where a whole input vector is one instruction), it is there
+        // for wider hidden layers (see Architecture in nnue.h)
+#if defined(USE_SIMD)
+        static constexpr bool SPARSE = BLOCKED && IN_SIZE % SIMD_WIDTH == 0;
+#else
+        static constexpr bool SPARSE = false;
+#endif
+
+        static constexpr size_t weight_index(size_t i, size_t o) {
+            if constexpr (BLOCKED)
+                return (i / 4) * OUT_SIZE * 4 + o * 4 + i % 4;
+            else
+                return o * IN_SIZE + i;
+        }
+
+        alignas(64) int8_t weights[OUT_SIZE * IN_SIZE];
+        alignas(64) int32_t bias[OUT_SIZE];
 };
 
 
 template <size_t IN_SIZE, size_t OUT_SIZE>
 void Linear<IN_SIZE, OUT_SIZE>::forward(const int8_t* input, int32_t* output) const {
-    for (size_t i = 0; i < OUT_SIZE; ++i) {
-        output[i] = bias[i];
-        for (size_t j = 0; j < IN_SIZE; ++j) {
-            output[i] += weights[j][i] * input[j];
+#if defined(USE_SIMD)
+    if constexpr (BLOCKED) {
+        constexpr size_t LANES = SIMD_WIDTH / sizeof(int32_t);
+        constexpr size_t REGS = OUT_SIZE / LANES;
+
+        vec_t acc[REGS];
+        for (size_t r = 0; r < REGS; ++r)
+            acc[r] = vec_load(bias + r * LANES);
+
+        // indexes of the blocks of 4 inputs to accumulate
+        uint16_t blocks[IN_SIZE / 4];
+        size_t numBlocks = 0;
+        if constexpr (SPARSE) {
+            for (size_t i = 0; i < IN_SIZE; i += SIMD_WIDTH) {
+                uint32_t nz = vec_nz_mask_32(vec_load(input + i));
+                while (nz) {
+                    blocks[numBlocks++] = i / 4 + std::countr_zero(nz);
+                    nz &= nz - 1;
+                }
+            }
+        }
+        else {
+            for (size_t b = 0; b < IN_SIZE / 4; ++b)
+                blocks[numBlocks++] = b;
+        }
+
+        for (size_t k = 0; k < numBlocks; ++k) {
+            size_t i = blocks[k] * 4;
+            // broadcast the block of 4 inputs to every lane
+            int32_t block;
+            std::memcpy(&block, input + i, sizeof(block));
+            vec_t in = vec_set1_32(block);
+
+            const int8_t* w = weights + i * OUT_SIZE;
+            for (size_t r = 0; r < REGS; ++r)
+                acc[r] = vec_dpbusd_32(acc[r], in, vec_load(w + r * SIMD_WIDTH));
+        }
+
+        for (size_t r = 0; r < REGS; ++r)
+            vec_store(output + r * LANES, acc[r]);
+        return;
+    }
+    else if constexpr (ROWS) {
+        for (size_t o = 0; o < OUT_SIZE; ++o) {
+            vec_t acc = vec_zero();
+            for (size_t i = 0; i < IN_SIZE; i += SIMD_WIDTH)
+                acc = vec_dpbusd_32(acc, vec_load(input + i), vec_load(weights + o * IN_SIZE + i));
+            output[o] = bias[o] + vec_reduce_32(acc);
+        }
+        return;
+    }
+#endif
+
+    for (size_t o = 0; o < OUT_SIZE; ++o) {
+        output[o] = bias[o];
+        for (size_t i = 0; i < IN_SIZE; ++i) {
+            output[o] += weights[weight_index(i, o)] * input[i];
         }
     }
 }
@@ -37,7 +137,11 @@ void Linear<IN_SIZE, OUT_SIZE>::forward(const int8_t* input, int32_t* output) co
 
 template <size_t IN_SIZE, size_t OUT_SIZE>
 const unsigned char* Linear<IN_SIZE, OUT_SIZE>::set_weights(const unsigned char* weights_start) {
-    std::memcpy(weights, weights_start, sizeof(weights));
+    const int8_t* fileWeights = reinterpret_cast<const int8_t*>(weights_start);
+    for (size_t o = 0; o < OUT_SIZE; ++o)
+        for (size_t i = 0; i < IN_SIZE; ++i)
+            weights[weight_index(i, o)] = fileWeights[o * IN_SIZE + i];
+
     std::memcpy(bias, weights_start + sizeof(weights), sizeof(bias));
     return weights_start + sizeof(weights) + sizeof(bias);
 }
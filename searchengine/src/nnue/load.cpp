@@ -1,109 +1,565 @@
 #include "load.h"
 #include "../types.h"
 #include "../position.h"
+#include "../misc.h"
 #include "features.h"
+#include "packed_sfen.h"
 
-#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
 #include <random>
+#include <thread>
 
 namespace harukashogi {
 namespace NNUE {
 
 
 DataBatch::DataBatch(std::vector<DataSample>& samples) {
-    batch_size = samples.size();
+    resize(samples.size());
 
-    // reserve memory for the vectors
-    black_indexes.reserve(batch_size * ACTIVE_FEATURES);
-    white_indexes.reserve(batch_size * ACTIVE_FEATURES);
-    scores.reserve(batch_size);
-    results.reserve(batch_size);
-    stms.reserve(batch_size);
+    // split the sample indexes into king bucket and piece feature
+    constexpr int PIECE_FEATURES = HalfKPFeatures::PIECE_FEATURES;
+    for (size_t i = 0; i < batch_size; ++i) {
+        const DataSample& sample = samples[i];
+        black_kings[i] = sample.black_indexes[0] / PIECE_FEATURES;
+        white_kings[i] = sample.white_indexes[0] / PIECE_FEATURES;
+        for (size_t k = 0; k < ACTIVE_FEATURES; ++k) {
+            black_indexes[i * ACTIVE_FEATURES + k] = sample.black_indexes[k] % PIECE_FEATURES;
+            white_indexes[i * ACTIVE_FEATURES + k] = sample.white_indexes[k] % PIECE_FEATURES;
+        }
+        buckets[i] = sample.bucket;
+        scores[i] = sample.score;
+        results[i] = sample.result;
+        stms[i] = sample.stm;
+    }
+}
+
+
+void DataBatch::resize(size_t size) {
+    batch_size = size;
+    black_indexes.resize(size * ACTIVE_FEATURES);
+    white_indexes.resize(size * ACTIVE_FEATURES);
+    black_kings.resize(size);
+    white_kings.resize(size);
+    buckets.resize(size);
+    scores.resize(size);
+    results.resize(size);
+    stms.resize(size);
+}
+
+
+void DataBatch::copy_sample(size_t j, const DataBatch& other, size_t i) {
+    std::memcpy(&black_indexes[j * ACTIVE_FEATURES], &other.black_indexes[i * ACTIVE_FEATURES],
+                ACTIVE_FEATURES * sizeof(FeatureIndex));
+    std::memcpy(&white_indexes[j * ACTIVE_FEATURES], &other.white_indexes[i * ACTIVE_FEATURES],
+                ACTIVE_FEATURES * sizeof(FeatureIndex));
+    black_kings[j] = other.black_kings[i];
+    white_kings[j] = other.white_kings[i];
+    buckets[j] = other.buckets[i];
+    scores[j] = other.scores[i];
+    results[j] = other.results[i];
+    stms[j] = other.stms[i];
+}
 
-    // add the samples to the vectors
-    for (const auto& sample : samples) {
-        black_indexes.insert(black_indexes.end(),
-                             sample.black_indexes.begin(),
-                             sample.black_indexes.end());
-        white_indexes.insert(white_indexes.end(),
-                             sample.white_indexes.begin(),
-                             sample.white_indexes.end());
-        scores.push_back(sample.score);
-        results.push_back(sample.result);
-        stms.push_back(sample.stm);
+
+// piece of each SFEN character, NO_PIECE for the other characters
+static const std::array<Piece, 128> CharToPiece = [] {
+    std::array<Piece, 128> table;
+    table.fill(NO_PIECE);
+    for (size_t i = 0; i < PieceToChar.size(); ++i)
+        if (PieceToChar[i] != ' ')
+            table[PieceToChar[i]] = Piece(i);
+    return table;
+}();
+
+
+// maximum number of pieces of each type in a hand
+constexpr int MAX_HAND_COUNT[NUM_UNPROMOTED_PIECE_TYPES] = {0, 4, 4, 4, 4, 2, 2, 18};
+
+
+bool parse_sfen(std::string_view sfen, SfenBoard& board) {
+    board.board.fill(NO_PIECE);
+    std::memset(board.hands, 0, sizeof(board.hands));
+    board.kingSq[BLACK] = board.kingSq[WHITE] = NUM_SQUARES;
+
+    size_t i = 0;
+    // 1. board pieces, from rank 1 and file 9
+    int rank = 0, file = NUM_FILES - 1;
+    bool promoted = false;
+    // the features have room for NUM_TOT_PIECES pieces, corrupt lines can have more
+    int numPieces = 0;
+    for (; i < sfen.size() && sfen[i] != ' '; ++i) {
+        char token = sfen[i];
+        if (token >= '1' && token <= '9')
+            file -= token - '0';
+        else if (token == '/') {
+            ++rank;
+            file = NUM_FILES - 1;
+        }
+        else if (token == '+')
+            promoted = true;
+        else {
+            Piece p = CharToPiece[token & 0x7F];
+            if (p == NO_PIECE || file < 0 || rank >= NUM_RANKS || ++numPieces > NUM_TOT_PIECES)
+                return false;
+            if (promoted)
+                p = promote_piece(p);
+            Square sq = make_square(File(file), Rank(rank));
+            board.board[sq] = p;
+            if (type_of(p) == KING)
+                board.kingSq[color_of(p)] = sq;
+            promoted = false;
+            --file;
+        }
     }
+
+    // 2. side to move
+    if (i + 2 >= sfen.size())
+        return false;
+    board.sideToMove = sfen[i + 1] == 'b' ? BLACK : WHITE;
+    i += 3;
+
+    // 3. hand pieces, with optional counts
+    int count = 0;
+    for (; i < sfen.size() && sfen[i] != ' '; ++i) {
+        char token = sfen[i];
+        if (token >= '0' && token <= '9') {
+            count = count * 10 + token - '0';
+            if (count > NUM_TOT_PIECES)
+                return false;
+        }
+        else if (token != '-') {
+            Piece p = CharToPiece[token & 0x7F];
+            if (p == NO_PIECE || type_of(p) == KING)
+                return false;
+            uint8_t& hand = board.hands[color_of(p)][type_of(p)];
+            hand += count ? count : 1;
+            numPieces += count ? count : 1;
+            if (hand > MAX_HAND_COUNT[type_of(p)] || numPieces > NUM_TOT_PIECES)
+                return false;
+            count = 0;
+        }
+    }
+
+    // compute_features writes exactly NUM_TOT_PIECES features
+    return numPieces == NUM_TOT_PIECES
+        && board.kingSq[BLACK] != NUM_SQUARES && board.kingSq[WHITE] != NUM_SQUARES;
 }
 
 
-DataSample compute_sample(std::string sfen, float score, float result, bool hflip) {
-    Position pos;
-    pos.set(sfen);
+DataSample compute_sample(std::string sfen, float score, float result, bool hflip, bool halfkp,
+                          size_t output_buckets) {
+    SfenBoard board;
+    if (!parse_sfen(sfen, board))
+        throw std::runtime_error("Invalid SFEN: " + sfen);
+    return compute_sample(board, score, result, hflip, halfkp, output_buckets);
+}
+
+
+// board_idx is linear in the square (+sq from black's view, -sq from white's), so the board
+// features are a per piece base plus or minus the (flipped) square
+struct BoardIndexTables {
+    int base[NUM_COLORS][NUM_PIECES + 1];
+    Square hflip[NUM_SQUARES];
+};
+
+static const BoardIndexTables BoardTables = [] {
+    BoardIndexTables tables{};
+    for (Piece p = B_KING; p <= P_W_PAWN; p = Piece(p + 1)) {
+        tables.base[BLACK][p] = board_idx<BLACK>(color_of(p), type_of(p), SQ_11);
+        tables.base[WHITE][p] = board_idx<WHITE>(color_of(p), type_of(p), SQ_11);
+    }
+    for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq)
+        tables.hflip[sq] = harukashogi::hflip(sq);
+    return tables;
+}();
 
-    DataSample sample;
-    sample.score = score;
-    sample.result = result;
-    sample.stm = pos.side_to_move() == BLACK ? 0.0f : 1.0f;
+
+// writes the ACTIVE_FEATURES piece features and the king bucket of each perspective,
+// returns the output bucket.
+// the indexes are written at the current count and the count only moves forward when there is
+// a feature, avoiding the unpredictable branches on the empty squares and on the hand counts
+// (the buffers have room for the extra writes at the end)
+static int compute_features(const SfenBoard& board, bool hflip, bool halfkp,
+                            size_t output_buckets, FeatureIndex* black_indexes,
+                            FeatureIndex* white_indexes, FeatureIndex& black_bucket,
+                            FeatureIndex& white_bucket) {
+    constexpr size_t BUFFER_SIZE = ACTIVE_FEATURES + MAX_HAND_COUNT[PAWN];
+    FeatureIndex black[BUFFER_SIZE], white[BUFFER_SIZE];
+
+    // bucket of each perspective (the king is flipped with the other pieces)
+    black_bucket = white_bucket = 0;
+    if (halfkp) {
+        Square black_king = board.kingSq[BLACK], white_king = board.kingSq[WHITE];
+        if (hflip) {
+            black_king = harukashogi::hflip(black_king);
+            white_king = harukashogi::hflip(white_king);
+        }
+        black_bucket = HalfKPFeatures::bucket<BLACK>(black_king);
+        white_bucket = HalfKPFeatures::bucket<WHITE>(white_king);
+    }
 
     size_t num_idxs = 0;
-    Piece p;
     // add the board indexes
     for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq) {
-        if ((p = pos.piece(sq)) != NO_PIECE) {
-            Square sq_flip = hflip ? harukashogi::hflip(sq) : sq;
-            PieceType pt = type_of(p);
-            Color c = color_of(p);
-            sample.black_indexes[num_idxs] = board_idx<BLACK>(c, pt, sq_flip);
-            sample.white_indexes[num_idxs] = board_idx<WHITE>(c, pt, sq_flip);
-            ++num_idxs;
-        }
+        Piece p = board.board[sq];
+        int sq_flip = hflip ? BoardTables.hflip[sq] : sq;
+        black[num_idxs] = BoardTables.base[BLACK][p] + sq_flip;
+        white[num_idxs] = BoardTables.base[WHITE][p] - sq_flip;
+        num_idxs += p != NO_PIECE;
     }
     // add the hand indexes
+    int hand_pieces = 0;
     for (Color c = BLACK; c < NUM_COLORS; ++c) {
         for (PieceType pt = GOLD; pt < NUM_UNPROMOTED_PIECE_TYPES; ++pt) {
-            for (int count = 0; count < pos.hand_count(c, pt); ++count) {
-                sample.black_indexes[num_idxs] = hand_idx<BLACK>(c, pt, count);
-                sample.white_indexes[num_idxs] = hand_idx<WHITE>(c, pt, count);
-                ++num_idxs;
+            int black_base = hand_idx<BLACK>(c, pt, 0);
+            int white_base = hand_idx<WHITE>(c, pt, 0);
+            for (int count = 0; count < MAX_HAND_COUNT[pt]; ++count) {
+                black[num_idxs + count] = black_base + count;
+                white[num_idxs + count] = white_base + count;
             }
+            num_idxs += board.hands[c][pt];
+            hand_pieces += board.hands[c][pt];
         }
     }
 
     assert(num_idxs == ACTIVE_FEATURES);
+    std::memcpy(black_indexes, black, ACTIVE_FEATURES * sizeof(FeatureIndex));
+    std::memcpy(white_indexes, white, ACTIVE_FEATURES * sizeof(FeatureIndex));
+
+    return output_bucket(hand_pieces, output_buckets);
+}
+
 
+DataSample compute_sample(const SfenBoard& board, float score, float result, bool hflip,
+                          bool halfkp, size_t output_buckets) {
+    DataSample sample;
+    sample.score = score;
+    sample.result = result;
+    sample.stm = board.sideToMove == BLACK ? 0.0f : 1.0f;
+    FeatureIndex black[ACTIVE_FEATURES], white[ACTIVE_FEATURES], black_bucket, white_bucket;
+    sample.bucket = compute_features(board, hflip, halfkp, output_buckets, black, white,
+                                     black_bucket, white_bucket);
+    // full feature indexes
+    for (size_t k = 0; k < ACTIVE_FEATURES; ++k) {
+        sample.black_indexes[k] = black_bucket * HalfKPFeatures::PIECE_FEATURES + black[k];
+        sample.white_indexes[k] = white_bucket * HalfKPFeatures::PIECE_FEATURES + white[k];
+    }
     return sample;
 }
 
 
-std::shared_ptr<DataBatch> load_data_batch(
+void DataBatch::set(size_t i, const SfenBoard& board, float score, float result, bool hflip,
+                    bool halfkp, size_t output_buckets) {
+    scores[i] = score;
+    results[i] = result;
+    stms[i] = board.sideToMove == BLACK ? 0.0f : 1.0f;
+    buckets[i] = compute_features(board, hflip, halfkp, output_buckets,
+                                  &black_indexes[i * ACTIVE_FEATURES],
+                                  &white_indexes[i * ACTIVE_FEATURES],
+                                  black_kings[i], white_kings[i]);
+}
+
+
+// packed training data (.bin files), the records are read directly from the mapped file.
+// the records that are not valid are skipped (and counted in the batch)
+static std::shared_ptr<DataBatch> load_packed_data_batch(
     const std::string& file_path,
     bool hflip,
-    bool random_hflip
+    bool random_hflip,
+    bool halfkp,
+    size_t output_buckets
 ) {
-    Position::init();
     std::mt19937 rng(std::random_device{}());
 
-    std::ifstream file(file_path);
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file: " + file_path);
+    MappedFile file(file_path);
+    size_t num_records = 0;
+    const PackedSample* records = packed_records(file.data(), file.size(), num_records);
+    if (!records) {
+        throw std::runtime_error("Corrupted data file: " + file_path);
+    }
+
+    auto batch = std::make_shared<DataBatch>(num_records);
+    size_t num_samples = 0;
+
+    SfenBoard board;
+    for (size_t i = 0; i < num_records; ++i) {
+        const PackedSample& record = records[i];
+        if (!unpack_sfen(record.sfen, board)) {
+            ++batch->skipped;
+            continue;
+        }
+
+        if (random_hflip) hflip = rng() % 2 == 0;
+        batch->set(num_samples++, board, record.score, (record.result + 1) / 2.0f,
+                   hflip, halfkp, output_buckets);
     }
 
-    std::vector<DataSample> samples;
-    std::string line, sfen;
+    batch->resize(num_samples);
+    return batch;
+}
+
+
+// parses a number after the optional spaces
+static bool parse_float(const char* first, const char* last, float& value) {
+    while (first < last && *first == ' ')
+        ++first;
+    return std::from_chars(first, last, value).ec == std::errc();
+}
+
+
+bool parse_data_line(std::string_view line, SfenBoard& board, float& score, float& result) {
+    size_t p1 = line.find('|');
+    size_t p2 = p1 == std::string_view::npos ? p1 : line.find('|', p1 + 1);
+    if (p2 == std::string_view::npos)
+        return false;
+
+    const char* data = line.data();
+    return parse_sfen(line.substr(0, p1), board)
+        && parse_float(data + p1 + 1, data + p2, score)
+        && parse_float(data + p2 + 1, data + line.size(), result);
+}
+
+
+std::shared_ptr<DataBatch> load_data_batch(
+    const std::string& file_path,
+    bool hflip,
+    bool random_hflip,
+    bool halfkp,
+    size_t output_buckets
+) {
+    if (std::filesystem::path(file_path).extension() == ".bin")
+        return load_packed_data_batch(file_path, hflip, random_hflip, halfkp, output_buckets);
+
+    std::mt19937 rng(std::random_device{}());
+
+    // "sfen | score | result" lines, parsed in place in the mapped file
+    MappedFile file(file_path);
+    const char* end = file.data() + file.size();
+
+    // one sample per line at most
+    size_t num_lines = std::count(file.data(), end, '\n') + 1;
+    auto batch = std::make_shared<DataBatch>(num_lines);
+    size_t num_samples = 0;
+
+    SfenBoard board;
     float score, result;
 
-    while (std::getline(file, line)) {
-        size_t p1 = line.find("|");
-        size_t p2 = line.find("|", p1 + 1);
+    for (const char* line = file.data(); line < end; ) {
+        const char* line_end = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!line_end)
+            line_end = end;
 
-        sfen = line.substr(0, p1);
-        score = std::stof(line.substr(p1 + 1, p2 - p1 - 1));
-        result = std::stof(line.substr(p2 + 1, line.size() - p2 - 1));
+        // lines without a separator (e.g. empty) are skipped
+        if (std::memchr(line, '|', line_end - line)) {
+            if (!parse_data_line(std::string_view(line, line_end - line), board, score, result))
+                throw std::runtime_error("Invalid line in data file: " + file_path);
 
-        if (random_hflip) hflip = rng() % 2 == 0;
-        samples.push_back(compute_sample(sfen, score, result, hflip));
+            if (random_hflip) hflip = rng() % 2 == 0;
+            batch->set(num_samples++, board, score, result, hflip, halfkp, output_buckets);
+        }
+
+        line = line_end + 1;
+    }
+
+    batch->resize(num_samples);
+    return batch;
+}
+
+
+// number of loaded files and of ready batches waiting to be used
+constexpr size_t FILE_QUEUE_SIZE = 16;
+constexpr size_t BATCH_QUEUE_SIZE = 8;
+
+
+DataStream::DataStream(
+    const std::vector<std::string>& files,
+    size_t batch_size,
+    bool shuffle,
+    size_t shuffle_buffer,
+    size_t num_threads,
+    bool hflip,
+    bool random_hflip,
+    bool halfkp,
+    size_t output_buckets
+) :
+    files(files),
+    batchSize(std::max<size_t>(batch_size, 1)),
+    // without shuffling the samples are taken in order, a batch at a time
+    shuffleBuffer(shuffle ? std::max(shuffle_buffer, batchSize) : batchSize),
+    shuffle(shuffle),
+    hflip(hflip),
+    randomHflip(random_hflip),
+    halfkp(halfkp),
+    outputBuckets(output_buckets),
+    fileBatches(FILE_QUEUE_SIZE),
+    batches(BATCH_QUEUE_SIZE)
+{
+    if (shuffle)
+        std::shuffle(this->files.begin(), this->files.end(), std::mt19937(std::random_device{}()));
+
+    // without shuffling a single reader keeps the files in order
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (!shuffle)
+        num_threads = 1;
+
+    activeReaders = num_threads;
+    for (size_t i = 0; i < num_threads; ++i)
+        readers.emplace_back(&DataStream::reader_loop, this);
+    batcher = std::thread(&DataStream::batcher_loop, this);
+}
+
+
+DataStream::~DataStream() {
+    // unblock the threads waiting on a full queue
+    fileBatches.close();
+    batches.close();
+    for (auto& reader : readers)
+        reader.join();
+    batcher.join();
+}
+
+
+std::shared_ptr<DataBatch> DataStream::next() {
+    std::shared_ptr<DataBatch> batch;
+    if (batches.pop(batch))
+        return batch;
+
+    std::unique_lock<std::mutex> lock(errorMutex);
+    if (error)
+        std::rethrow_exception(error);
+    return nullptr;
+}
+
+
+void DataStream::set_error(std::exception_ptr e) {
+    {
+        std::unique_lock<std::mutex> lock(errorMutex);
+        if (!error)
+            error = e;
+    }
+    fileBatches.close();
+    batches.close();
+}
+
+
+void DataStream::reader_loop() {
+    try {
+        size_t i;
+        while ((i = nextFile++) < files.size()) {
+            auto batch = load_data_batch(files[i], hflip, randomHflip, halfkp, outputBuckets);
+            skippedRecords += batch->skipped;
+            if (!fileBatches.push(std::move(batch)))
+                break;
+        }
+    } catch (...) {
+        set_error(std::current_exception());
+    }
+
+    // the last reader tells the batcher that there are no more files
+    if (--activeReaders == 0)
+        fileBatches.close();
+}
+
+
+void DataStream::batcher_loop() {
+    std::mt19937 rng(std::random_device{}());
+
+    // shuffle buffer, with room for a whole file on top of the buffered samples.
+    // the samples are buffer[start, size), start is only moved without shuffling (the samples
+    // are taken from the front) and the buffer is compacted when the next file is added
+    DataBatch buffer(0);
+    size_t start = 0, size = 0;
+
+    auto emit_batch = [&]() {
+        size_t n = std::min(batchSize, size - start);
+        auto batch = std::make_shared<DataBatch>(n);
+        for (size_t j = 0; j < n; ++j) {
+            if (shuffle) {
+                // draw a random sample and fill its place with the last one
+                size_t i = rng() % size;
+                batch->copy_sample(j, buffer, i);
+                buffer.copy_sample(i, buffer, --size);
+            }
+            else
+                batch->copy_sample(j, buffer, start++);
+        }
+        return batches.push(std::move(batch));
+    };
+
+    std::shared_ptr<DataBatch> fileBatch;
+    while (fileBatches.pop(fileBatch)) {
+        if (start > 0) {
+            for (size_t i = start; i < size; ++i)
+                buffer.copy_sample(i - start, buffer, i);
+            size -= start;
+            start = 0;
+        }
+        if (buffer.batch_size < size + fileBatch->batch_size)
+            buffer.resize(size + fileBatch->batch_size);
+        for (size_t i = 0; i < fileBatch->batch_size; ++i)
+            buffer.copy_sample(size++, *fileBatch, i);
+        fileBatch.reset();
+
+        while (size - start >= shuffleBuffer)
+            if (!emit_batch())
+                return;
+    }
+
+    // no more files: empty the buffer
+    while (size > start)
+        if (!emit_batch())
+            return;
+
+    batches.close();
+}
+
+
+std::vector<int32_t> evaluate_batch(
+    const std::vector<std::string>& sfens,
+    const std::string& eval_file,
+    size_t num_threads
+) {
+    Position::init();
+
+    NNUE nnue;
+    if (!eval_file.empty() && !nnue.load(eval_file)) {
+        throw std::runtime_error("Failed to load network file: " + eval_file);
+    }
+
+    if (num_threads == 0)
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, std::max<size_t>(sfens.size(), 1));
+
+    std::vector<int32_t> evals(sfens.size());
+
+    // each thread evaluates a contiguous range, consecutive positions (e.g. from the same game)
+    // are cheaper to compute with the refresh cache of the accumulator stack
+    auto worker = [&](size_t begin, size_t end) {
+        auto accStack = std::make_unique<AccumulatorStack>(nnue);
+        Position pos;
+        for (size_t i = begin; i < end; ++i) {
+            pos.set(sfens[i]);
+            accStack->clear();
+            accStack->compute(pos);
+            evals[i] = nnue.evaluate(*accStack, pos);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    size_t chunk = (sfens.size() + num_threads - 1) / num_threads;
+    for (size_t t = 0; t < num_threads; ++t) {
+        size_t begin = std::min(t * chunk, sfens.size());
+        size_t end = std::min(begin + chunk, sfens.size());
+        threads.emplace_back(worker, begin, end);
     }
+    for (auto& thread : threads)
+        thread.join();
 
-    return std::make_shared<DataBatch>(samples);
+    return evals;
 }
 
 
@@ -1,11 +1,25 @@
 #ifndef LOADER_H
 #define LOADER_H
 
+#include <cstdint>
 #include <vector>
 #include <array>
 #include <memory>
+#include <string_view>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <filesystem>
+#include <stdexcept>
 
 #include "nnue.h"
+#include "features.h"
+#include "packed_sfen.h"
+#include "../misc.h"
 
 namespace harukashogi {
 namespace NNUE {
@@ -13,10 +27,19 @@ namespace NNUE {
 
 constexpr size_t ACTIVE_FEATURES = 40;
 
+// the batches store the piece feature (board_idx / hand_idx) and the king bucket of each
+// perspective apart, the HalfKP index being bucket * PIECE_FEATURES + piece feature,
+// so that both fit in 16 bits
+using FeatureIndex = int16_t;
+static_assert(HalfKPFeatures::PIECE_FEATURES <= INT16_MAX &&
+              HalfKPFeatures::NUM_BUCKETS <= INT16_MAX, "the feature indexes must fit in int16");
+
 
 struct DataSample {
     std::array<int, ACTIVE_FEATURES> black_indexes;
     std::array<int, ACTIVE_FEATURES> white_indexes;
+    // output bucket (head) of the position, see output_bucket
+    int bucket;
     float score;
     float result;
     float stm;
@@ -25,22 +48,189 @@ struct DataSample {
 
 struct DataBatch {
     DataBatch(std::vector<DataSample>& samples);
+    // batch of size samples, to be filled in with set (no intermediate DataSample)
+    DataBatch(size_t size) { resize(size); }
+
+    // computes the i-th sample, as compute_sample
+    void set(size_t i, const SfenBoard& board, float score, float result, bool hflip,
+             bool halfkp, size_t output_buckets);
+    void resize(size_t size);
+    // copies the i-th sample of other to the j-th sample of this batch
+    void copy_sample(size_t j, const DataBatch& other, size_t i);
 
     size_t batch_size = 0;
 
-    std::vector<int> black_indexes;
-    std::vector<int> white_indexes;
+    // batch_size x ACTIVE_FEATURES piece features, row major
+    std::vector<FeatureIndex> black_indexes;
+    std::vector<FeatureIndex> white_indexes;
+    // HalfKP king bucket of each perspective, 0 with PieceFeatures
+    std::vector<FeatureIndex> black_kings;
+    std::vector<FeatureIndex> white_kings;
+    std::vector<int> buckets;
     std::vector<float> scores;
     std::vector<float> results;
     std::vector<float> stms;
+
+    // records of the data file that were not valid, they are not in the batch
+    size_t skipped = 0;
+};
+
+
+// whole data file memory mapped for reading, unmapped on destruction
+class MappedFile {
+    public:
+        MappedFile(const std::string& path) {
+            std::error_code ec;
+            fileSize = std::filesystem::file_size(path, ec);
+            if (ec)
+                throw std::runtime_error("Failed to open file: " + path);
+            if (fileSize > 0 && !(mem = map_file(path, 0, fileSize)))
+                throw std::runtime_error("Failed to open file: " + path);
+        }
+        ~MappedFile() { if (mem) unmap_file(mem, fileSize); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const { return static_cast<const char*>(mem); }
+        size_t size() const { return fileSize; }
+
+    private:
+        void* mem = nullptr;
+        size_t fileSize = 0;
 };
 
 
-DataSample compute_sample(std::string sfen, float score, float result, bool hflip = false);
+// halfkp selects the king relative feature set (HalfKPFeatures) instead of PieceFeatures,
+// output_buckets is the number of heads of the trained network
+DataSample compute_sample(std::string sfen, float score, float result, bool hflip = false,
+                          bool halfkp = false, size_t output_buckets = 1);
+DataSample compute_sample(const SfenBoard& board, float score, float result, bool hflip = false,
+                          bool halfkp = false, size_t output_buckets = 1);
+
+// lightweight SFEN decoder, fills in only what the features need (no Position is built).
+// returns false if the string is not a valid SFEN or does not have the NUM_TOT_PIECES pieces
+// of a game (ACTIVE_FEATURES features)
+bool parse_sfen(std::string_view sfen, SfenBoard& board);
+// parses a "sfen | score | result" line of a text data file, returns false if it is not valid
+bool parse_data_line(std::string_view line, SfenBoard& board, float& score, float& result);
+// loads a text ("sfen | score | result" lines) or a packed (.bin, see PackedSample) data file.
+// throws if the file can't be read, or for a text line or a packed file header that is not
+// valid. packed records that are not valid are skipped
 std::shared_ptr<DataBatch> load_data_batch(
     const std::string& file_path,
     bool hflip = false,
-    bool random_hflip = false
+    bool random_hflip = false,
+    bool halfkp = false,
+    size_t output_buckets = 1
+);
+
+
+// queue with a maximum size between producer and consumer threads.
+// after close, push fails and pop returns the remaining items and then fails
+template <typename T>
+class BoundedQueue {
+    public:
+        BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+            if (closed)
+                return false;
+            items.push_back(std::move(item));
+            notEmpty.notify_one();
+            return true;
+        }
+
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+            if (items.empty())
+                return false;
+            item = std::move(items.front());
+            items.pop_front();
+            notFull.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::unique_lock<std::mutex> lock(mutex);
+            closed = true;
+            notFull.notify_all();
+            notEmpty.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable notFull, notEmpty;
+        std::deque<T> items;
+        size_t capacity;
+        bool closed = false;
+};
+
+
+// streams batches of batch_size samples (the last one can be smaller) from a list of data
+// files, one pass over the files. reader threads load the files (in a random order if
+// shuffle) and a batcher thread mixes their samples in a buffer of shuffle_buffer samples
+// before drawing the batches at random, so that samples from different files end up in the
+// same batch. the next batches are prepared while the previous ones are used.
+// num_threads = 0 uses all the cores for the readers
+class DataStream {
+    public:
+        DataStream(
+            const std::vector<std::string>& files,
+            size_t batch_size,
+            bool shuffle = true,
+            size_t shuffle_buffer = 1 << 19,
+            size_t num_threads = 0,
+            bool hflip = false,
+            bool random_hflip = false,
+            bool halfkp = false,
+            size_t output_buckets = 1
+        );
+        ~DataStream();
+
+        DataStream(const DataStream&) = delete;
+        DataStream& operator=(const DataStream&) = delete;
+
+        // blocks until the next batch is ready, nullptr after the last one.
+        // rethrows the errors of the reader threads (e.g. a file that can't be loaded)
+        std::shared_ptr<DataBatch> next();
+
+        // records skipped by the readers so far (see DataBatch::skipped)
+        size_t skipped() const { return skippedRecords; }
+
+    private:
+        void reader_loop();
+        void batcher_loop();
+        void set_error(std::exception_ptr e);
+
+        std::vector<std::string> files;
+        size_t batchSize, shuffleBuffer;
+        bool shuffle, hflip, randomHflip, halfkp;
+        size_t outputBuckets;
+
+        std::atomic<size_t> nextFile = 0;
+        std::atomic<size_t> activeReaders = 0;
+        std::atomic<size_t> skippedRecords = 0;
+        BoundedQueue<std::shared_ptr<DataBatch>> fileBatches, batches;
+
+        std::mutex errorMutex;
+        std::exception_ptr error;
+
+        std::vector<std::thread> readers;
+        std::thread batcher;
+};
+
+
+// static evaluation (stm relative, as NNUE::evaluate) of many positions, split across threads.
+// eval_file is a network file as for the EvalFile option (the embedded network if empty),
+// num_threads = 0 uses all the cores
+std::vector<int32_t> evaluate_batch(
+    const std::vector<std::string>& sfens,
+    const std::string& eval_file = "",
+    size_t num_threads = 0
 );
 
 
@@ -4,6 +4,8 @@
 #include "incbin.h"
 
 #include <cstring>
+#include <cassert>
+#include <filesystem>
 
 namespace harukashogi {
 namespace NNUE {
@@ -16,48 +18,312 @@ namespace NNUE {
 INCBIN(Weights, "../bin/nnue/AdamW_acc32_21M_l5.bin");
 
 
-NNUE::NNUE() {
-    const unsigned char* ptr = gWeightsData;
-    ptr = ft.set_weights(ptr);
-    l1.set_weights(ptr);
+// network files start with a header describing the architecture, followed by the weights in
+// the same layout as the embedded network (the one written by the trainer).
+// the header takes a cache line, so that the feature transformer weights (used in place from the
+// mapped file) are aligned as the embedded ones
+struct NetFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t features;
+    uint32_t accumulatorSize;
+    // hash of the dense layer sizes (LayerStack::hash)
+    uint32_t layersHash;
+    // number of heads, in [1, MAX_OUTPUT_BUCKETS]
+    uint32_t outputBuckets;
+    uint32_t reserved;
+    uint64_t payloadSize;
+    // FNV-1a hash of the weights
+    uint64_t checksum;
+    uint8_t padding[16];
+};
+
+static_assert(sizeof(NetFileHeader) == 64, "the weights start on a cache line");
+
+constexpr char NET_FILE_MAGIC[8] = {'H', 'A', 'R', 'U', 'K', 'A', 'N', 'N'};
+constexpr uint32_t NET_FILE_VERSION = 4;
+
+
+static uint64_t fnv1a(const unsigned char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+// checks the header and the weights against the architecture (feature set F, accumulator size ACC),
+// and creates the network if they match
+template <typename F, size_t ACC>
+static bool load_network(const NetFileHeader& header, const unsigned char* weights,
+                         size_t weightsSize, ByArchitecture<NetworkPtr>& network) {
+    using Arch = Architecture<F, ACC>;
+
+    size_t payloadSize = Arch::payload_size(header.outputBuckets);
+    if (header.layersHash != Arch::LayerStackType::hash() ||
+        header.outputBuckets < 1 || header.outputBuckets > MAX_OUTPUT_BUCKETS ||
+        header.payloadSize != payloadSize ||
+        weightsSize != payloadSize ||
+        header.checksum != fnv1a(weights, payloadSize))
+        return false;
+
+    auto net = std::make_unique<Network<F, ACC>>();
+    net->set_weights(weights, header.outputBuckets);
+    network = std::move(net);
+    return true;
 }
 
 
-int32_t NNUE::evaluate(const AccumulatorType& acc, Color stm) const {
-    int8_t actAcc[2*ACCUMULATOR_SIZE];
-    crelu16<ACCUMULATOR_SIZE>(acc[stm], actAcc);
-    crelu16<ACCUMULATOR_SIZE>(acc[~stm], actAcc + ACCUMULATOR_SIZE);
+template <typename F>
+static bool load_network(const NetFileHeader& header, const unsigned char* weights,
+                         size_t weightsSize, ByArchitecture<NetworkPtr>& network) {
+    // the supported accumulator sizes (see ByArchitecture)
+    switch (header.accumulatorSize) {
+        case 8:  return load_network<F, 8>(header, weights, weightsSize, network);
+        case 16: return load_network<F, 16>(header, weights, weightsSize, network);
+        case 32: return load_network<F, 32>(header, weights, weightsSize, network);
+        case 64: return load_network<F, 64>(header, weights, weightsSize, network);
+        default: return false;
+    }
+}
+
+
+template <typename F, size_t ACC>
+void Network<F, ACC>::set_weights(const unsigned char* weights, size_t outputBuckets) {
+    numOutputBuckets = outputBuckets;
+    const unsigned char* ptr = ft.set_weights(weights);
+    for (size_t i = 0; i < outputBuckets; ++i)
+        ptr = layers[i].set_weights(ptr);
+}
+
+
+template <typename F, size_t ACC>
+int32_t Network<F, ACC>::evaluate(const typename Arch::AccumulatorType& acc, Color stm,
+                                  size_t bucket) const {
+    alignas(64) int8_t actAcc[2*ACC];
+    crelu16<ACC>(acc[stm], actAcc);
+    crelu16<ACC>(acc[~stm], actAcc + ACC);
 
     int32_t score;
-    l1.forward(actAcc, &score);
+    layers[bucket].forward(actAcc, &score);
     
     return (score * SCALE) / (Q1 * Q2);
 }
 
 
-void AccumulatorStack::push() {
+NNUE::NNUE() {
+    load_embedded();
+}
+
+
+NNUE::~NNUE() {
+    release_mapping();
+}
+
+
+void NNUE::release_mapping() {
+    if (mapping)
+        unmap_file(mapping, mappingSize);
+    mapping = nullptr;
+    mappingSize = 0;
+}
+
+
+void NNUE::load_embedded() {
+    using Arch = Architecture<DefaultFeatureSet, DEFAULT_ACCUMULATOR_SIZE>;
+    assert(gWeightsSize == Arch::payload_size(1));
+    auto net = std::make_unique<Network<DefaultFeatureSet, DEFAULT_ACCUMULATOR_SIZE>>();
+    net->set_weights(gWeightsData, 1);
+    network = std::move(net);
+    release_mapping();
+}
+
+
+bool NNUE::load(const std::string& path) {
+    // a truncated file would fault when accessing the missing pages
+    std::error_code ec;
+    size_t fileSize = std::filesystem::file_size(path, ec);
+    if (ec || fileSize < sizeof(NetFileHeader))
+        return false;
+
+    void* mem = map_file(path, 0, fileSize, true);
+    if (!mem)
+        return false;
+
+    const unsigned char* data = static_cast<const unsigned char*>(mem);
+    NetFileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    const unsigned char* weights = data + sizeof(header);
+    size_t weightsSize = fileSize - sizeof(header);
+
+    // reject files with a different format or architecture, or corrupted weights
+    bool valid = std::memcmp(header.magic, NET_FILE_MAGIC, sizeof(NET_FILE_MAGIC)) == 0 &&
+                 header.version == NET_FILE_VERSION;
+
+    // the feature set is identified by its number of features
+    if (valid) {
+        if (header.features == PieceFeatures::SIZE)
+            valid = load_network<PieceFeatures>(header, weights, weightsSize, network);
+        else if (header.features == HalfKPFeatures::SIZE)
+            valid = load_network<HalfKPFeatures>(header, weights, weightsSize, network);
+        else
+            valid = false;
+    }
+
+    // the new network reads its feature transformer weights from the mapping, the one of the
+    // previous network can be released
+    if (valid) {
+        release_mapping();
+        mapping = mem;
+        mappingSize = fileSize;
+    }
+    else
+        unmap_file(mem, fileSize);
+    return valid;
+}
+
+
+size_t NNUE::accumulator_size() const {
+    return std::visit([](const auto& net) { return net->SIZE; }, network);
+}
+
+
+size_t NNUE::num_features() const {
+    return std::visit([](const auto& net) {
+        return std::remove_reference_t<decltype(*net)>::FeatureSet::SIZE;
+    }, network);
+}
+
+
+int32_t NNUE::evaluate(AccumulatorStack& accStack, const Position& pos) const {
+    return std::visit([&](const auto& net) {
+        using Net = std::remove_reference_t<decltype(*net)>;
+        using Stack = SizedAccumulatorStack<typename Net::FeatureSet, Net::SIZE>;
+        return net->evaluate(std::get<Stack>(accStack.stack).top(pos), pos.side_to_move(),
+                             output_bucket(pos, net->output_buckets()));
+    }, network);
+}
+
+
+template <typename F, size_t ACC>
+void SizedAccumulatorStack<F, ACC>::push() {
     assert(size < MAX_PLY+1);
-    stack[size] = stack[size-1];
+    // no features change, the accumulator is copied from the parent when needed
+    State& st = stack[size];
+    st.dirty = DirtyPieces();
+    for (Color p = BLACK; p < NUM_COLORS; ++p) {
+        st.bucket[p] = stack[size-1].bucket[p];
+        st.refresh[p] = st.computed[p] = false;
+    }
     size++;
 }
 
 
-void AccumulatorStack::push(const Position& pos, Move m) {
+template <typename F, size_t ACC>
+void SizedAccumulatorStack<F, ACC>::push(const Position& pos, Move m) {
     assert(size < MAX_PLY+1);
-    ft.incremental_update(pos, m, stack[size-1], stack[size]);
+    State& st = stack[size];
+    st.dirty = Arch::FeatureTransformerType::dirty_pieces(pos, m);
+    for (Color p = BLACK; p < NUM_COLORS; ++p) {
+        st.refresh[p] = needs_refresh<F>(st.dirty, p);
+        st.computed[p] = false;
+    }
+    // the bucket only changes with a move of the own king
+    st.bucket[BLACK] = st.refresh[BLACK] ? F::template bucket<BLACK>(m.to())
+                                         : stack[size-1].bucket[BLACK];
+    st.bucket[WHITE] = st.refresh[WHITE] ? F::template bucket<WHITE>(m.to())
+                                         : stack[size-1].bucket[WHITE];
     size++;
 }
 
 
-void AccumulatorStack::pop() {
+template <typename F, size_t ACC>
+void SizedAccumulatorStack<F, ACC>::pop() {
     assert(size > 1);
     size--;
 }
 
 
-void AccumulatorStack::compute(const Position& pos) {
+template <typename F, size_t ACC>
+void SizedAccumulatorStack<F, ACC>::compute(const Position& pos) {
     assert(size == 1);
-    ft.forward(pos, stack[0]);
+    ft->refresh(pos, stack[0].acc, refreshCache);
+    stack[0].bucket[BLACK] = ft->template bucket<BLACK>(pos);
+    stack[0].bucket[WHITE] = ft->template bucket<WHITE>(pos);
+    stack[0].computed[BLACK] = stack[0].computed[WHITE] = true;
+}
+
+
+template <typename F, size_t ACC>
+template <Color perspective>
+void SizedAccumulatorStack<F, ACC>::update(const Position& pos) {
+    // find the nearest computed accumulator, or a move of the own king
+    // (the root one is always computed)
+    int last = size - 1;
+    while (!stack[last].computed[perspective] && !stack[last].refresh[perspective])
+        last--;
+
+    // the bucket changed, refresh the top from the position
+    if (!stack[last].computed[perspective]) {
+        ft->template refresh<perspective>(pos, stack[size-1].acc, refreshCache);
+        stack[size-1].computed[perspective] = true;
+        return;
+    }
+
+    // apply the recorded changes up to the top
+    for (int i = last + 1; i < size; i++) {
+        ft->template incremental_update<perspective>(
+            stack[i].dirty, stack[i].bucket[perspective], stack[i-1].acc, stack[i].acc
+        );
+        stack[i].computed[perspective] = true;
+    }
+}
+
+
+template <typename F, size_t ACC>
+typename Architecture<F, ACC>::AccumulatorType& SizedAccumulatorStack<F, ACC>::top(
+    const Position& pos
+) {
+    update<BLACK>(pos);
+    update<WHITE>(pos);
+    return stack[size-1].acc;
+}
+
+
+void AccumulatorStack::reset(const NNUE& nnue) {
+    std::visit([&](const auto& net) {
+        using Net = std::remove_reference_t<decltype(*net)>;
+        stack.emplace<SizedAccumulatorStack<typename Net::FeatureSet, Net::SIZE>>(
+            net->feature_transformer()
+        );
+    }, nnue.network);
+}
+
+
+void AccumulatorStack::push(const Position& pos, Move m) {
+    std::visit([&](auto& s) { s.push(pos, m); }, stack);
+}
+
+
+void AccumulatorStack::push() {
+    std::visit([](auto& s) { s.push(); }, stack);
+}
+
+
+void AccumulatorStack::pop() {
+    std::visit([](auto& s) { s.pop(); }, stack);
+}
+
+
+void AccumulatorStack::clear() {
+    std::visit([](auto& s) { s.clear(); }, stack);
+}
+
+
+void AccumulatorStack::compute(const Position& pos) {
+    std::visit([&](auto& s) { s.compute(pos); }, stack);
 }
 
 }
@@ -2,10 +2,14 @@
 #define NNUE_H
 
 #include <cstdint>
+#include <string>
+#include <memory>
+#include <variant>
 
 #include "accumulator.h"
 #include "layers/ft.h"
 #include "layers/linear.h"
+#include "layers/layer_stack.h"
 #include "../position.h"
 #include "../types.h"
 #include "../misc.h"
@@ -14,56 +18,202 @@ namespace harukashogi {
 namespace NNUE {
 
 
-constexpr size_t FEATURES = 2 * NUM_SQUARES * NUM_PIECE_TYPES + 2 * 2 * 19;
-constexpr size_t ACCUMULATOR_SIZE = 32;
+// architecture of the embedded network, networks with any of the supported feature sets and
+// accumulator sizes (see ByArchitecture) can be loaded at runtime
+using DefaultFeatureSet = PieceFeatures;
+constexpr size_t DEFAULT_ACCUMULATOR_SIZE = 32;
+// a network has one or more output heads (dense layer stacks), one is selected for each position
+// by output_bucket. the embedded network has a single head
+constexpr size_t MAX_OUTPUT_BUCKETS = 8;
 constexpr int Q1 = 127; // needs to fit in int8_t [-128, 127]
-constexpr int Q2 = 64;  // weights need to fit in int8_t, so max weight value is  2
+constexpr int Q2_SHIFT = 6;
+constexpr int Q2 = 1 << Q2_SHIFT;  // weights need to fit in int8_t, so max weight value is  2
 constexpr int SCALE = 2000; // needs to be adjusted
 
-// define aliases for the template classes
-// reduces verbosity in the code
-using AccumulatorType = Accumulator<ACCUMULATOR_SIZE>;
-using FeatureTransformerType = FeatureTransformer<FEATURES, ACCUMULATOR_SIZE>;
 
+// architecture of the network for a given feature set and accumulator size:
+// feature transformer -> crelu (both perspectives, stm first) -> dense layers (see LayerStack).
+// a deeper network only needs a different list of layers, e.g.
+// LayerStack<Q2_SHIFT, Linear<2*ACC, 16>, Linear<16, 32>, Linear<32, 1>>
+template <typename F, size_t ACC>
+struct Architecture {
+    using FeatureSet = F;
+    using AccumulatorType = Accumulator<ACC>;
+    using FeatureTransformerType = FeatureTransformer<F, ACC>;
+    using RefreshCacheType = RefreshCache<F, ACC>;
+    using LayerStackType = LayerStack<Q2_SHIFT, Linear<2*ACC, 1>>;
+
+    static_assert(LayerStackType::INPUT_SIZE == 2*ACC && LayerStackType::OUTPUT_SIZE == 1);
+
+    // size of the weights in the network files, the heads are stored one after the other
+    static constexpr size_t payload_size(size_t outputBuckets) {
+        return FeatureTransformerType::FILE_SIZE + outputBuckets * LayerStackType::FILE_SIZE;
+    }
+};
 
-class AccumulatorStack {
+
+// head used to evaluate the position, from the number of pieces in the hands
+// (fewer pieces on the board as the game goes on)
+inline size_t output_bucket(int handPieces, size_t outputBuckets) {
+    // at most NUM_TOT_PIECES - 2 pieces in the hands (kings)
+    return size_t(handPieces) * outputBuckets / NUM_TOT_PIECES;
+}
+
+inline size_t output_bucket(const Position& pos, size_t outputBuckets) {
+    return output_bucket(pos.hand_pieces(), outputBuckets);
+}
+
+
+// variant over the supported architectures, each one is a separate instantiation of the
+// network and of the accumulator stack
+template <template <typename, size_t> typename T>
+using ByArchitecture = std::variant<
+    T<PieceFeatures, 8>, T<PieceFeatures, 16>, T<PieceFeatures, 32>, T<PieceFeatures, 64>,
+    T<HalfKPFeatures, 8>, T<HalfKPFeatures, 16>, T<HalfKPFeatures, 32>, T<HalfKPFeatures, 64>
+>;
+
+
+// stack of the accumulators along the searched line.
+// the updates are lazy: making a move only records the features it changes, and the accumulator
+// is computed when top() is called, starting from the nearest computed ancestor.
+// nodes cut off before being evaluated never pay for the feature transformer.
+// the perspectives are computed separately: after a move of its own king a perspective is
+// refreshed from the position instead (see needs_refresh).
+template <typename F, size_t ACC>
+class SizedAccumulatorStack {
     public:
-        AccumulatorStack(const FeatureTransformerType& ft) : ft(ft) {}
+        using Arch = Architecture<F, ACC>;
+
+        SizedAccumulatorStack() {}
+        SizedAccumulatorStack(const typename Arch::FeatureTransformerType& ft) : ft(&ft) {}
         
-        // incrementally update the accumulator and push the new accumulator to the stack
+        // record the features changed by the move and push a new (not computed) accumulator
         void push(const Position& pos, Move m);
-        // push a copy of the top accumulator to the stack
+        // push an accumulator equal to the top one (null move)
         void push();
 
         void pop();
         
         void clear() { size = 1; }
 
-        // computes the top accumulator from scratch
+        // computes the root accumulator, using the refresh cache
         void compute(const Position& pos);
 
-        AccumulatorType& top() { return stack[size-1]; }
+        // returns the top accumulator, computing it if needed (pos is the top position)
+        typename Arch::AccumulatorType& top(const Position& pos);
 
     private:
-        std::array<AccumulatorType, MAX_PLY+1> stack;
+        template <Color perspective>
+        void update(const Position& pos);
+
+        struct State {
+            typename Arch::AccumulatorType acc;
+            DirtyPieces dirty;
+            size_t bucket[NUM_COLORS];
+            bool refresh[NUM_COLORS];
+            bool computed[NUM_COLORS];
+        };
+
+        std::array<State, MAX_PLY+1> stack;
         int size = 1;
 
-        const FeatureTransformerType& ft;
+        // per thread, as the stack
+        typename Arch::RefreshCacheType refreshCache;
+
+        const typename Arch::FeatureTransformerType* ft = nullptr;
 };
 
 
+template <typename F, size_t ACC>
+class Network {
+    public:
+        using Arch = Architecture<F, ACC>;
+        using FeatureSet = F;
+        static constexpr size_t SIZE = ACC;
+
+        // set the weights from the payload of a network file (or the embedded network)
+        void set_weights(const unsigned char* weights, size_t outputBuckets);
+
+        // evaluate the position from the accumulator with the head of the output bucket
+        int32_t evaluate(const typename Arch::AccumulatorType& acc, Color stm, size_t bucket) const;
+
+        size_t output_buckets() const { return numOutputBuckets; }
+
+        const typename Arch::FeatureTransformerType& feature_transformer() const { return ft; }
+
+    private:
+        typename Arch::FeatureTransformerType ft;
+        typename Arch::LayerStackType layers[MAX_OUTPUT_BUCKETS];
+        size_t numOutputBuckets = 1;
+};
+
+
+template <typename F, size_t ACC>
+using NetworkPtr = std::unique_ptr<Network<F, ACC>>;
+
+
+class AccumulatorStack;
+
+
+// the network used by the engine, its feature set and accumulator size are chosen when loading
 class NNUE {
     public:
+        // loads the embedded network
         NNUE();
+        ~NNUE();
 
-        // evaluate the position from the accumulator
-        int32_t evaluate(const AccumulatorType& acc, Color stm) const;
+        NNUE(const NNUE&) = delete;
+        NNUE& operator=(const NNUE&) = delete;
 
-        const FeatureTransformerType& feature_transformer() const { return ft; }
+        // load the weights from a network file (see nnue.cpp for the format), the file is
+        // memory mapped (read only) and validated before replacing the current network.
+        // the feature transformer weights, most of the network, are used in place: the engine
+        // processes loading the same file share its pages. the dense layers are copied (they
+        // are permuted into their SIMD layout).
+        // the architecture is read from the header.
+        // returns false (and keeps the current network) if the file is missing or not valid
+        bool load(const std::string& path);
+        void load_embedded();
+
+        size_t accumulator_size() const;
+        size_t num_features() const;
+
+        // evaluate the position from the top accumulator of the stack
+        // (the stack must have been reset with this network)
+        int32_t evaluate(AccumulatorStack& accStack, const Position& pos) const;
 
     private:
-        FeatureTransformerType ft;
-        Linear<2*ACCUMULATOR_SIZE, 1> l1;
+        friend class AccumulatorStack;
+
+        // unmaps the network file, after the network using it has been replaced
+        void release_mapping();
+
+        ByArchitecture<NetworkPtr> network;
+        // mapping of the loaded network file, nullptr for the embedded network
+        // (its weights are read from the binary)
+        void* mapping = nullptr;
+        size_t mappingSize = 0;
+};
+
+
+// accumulator stack matching the accumulator size of a network
+class AccumulatorStack {
+    public:
+        AccumulatorStack(const NNUE& nnue) { reset(nnue); }
+
+        // rebuild the stack for the current network of nnue (also clears the refresh cache)
+        void reset(const NNUE& nnue);
+
+        void push(const Position& pos, Move m);
+        void push();
+        void pop();
+        void clear();
+        void compute(const Position& pos);
+
+    private:
+        friend class NNUE;
+
+        ByArchitecture<SizedAccumulatorStack> stack;
 };
 
 
@@ -0,0 +1,215 @@
+#include "packed_sfen.h"
+
+#include <cstring>
+#include <cassert>
+
+namespace harukashogi {
+namespace NNUE {
+
+
+struct HuffmanCode {
+    // the bits are written starting from the least significant one
+    uint8_t code;
+    uint8_t bits;
+};
+
+// indexed by the unpromoted piece type, the king is stored separately.
+// on the board a piece is preceded by a 1 bit (0 is an empty square)
+constexpr HuffmanCode PieceCodes[NUM_UNPROMOTED_PIECE_TYPES] = {
+    {0b00000, 0}, // KING
+    {0b00111, 4}, // GOLD
+    {0b00011, 3}, // SILVER
+    {0b00001, 3}, // LANCE
+    {0b00101, 3}, // KNIGHT
+    {0b01111, 5}, // BISHOP
+    {0b11111, 5}, // ROOK
+    {0b00000, 1}, // PAWN
+};
+
+// pieces other than the kings
+constexpr int NUM_PACKED_PIECES = NUM_TOT_PIECES - 2;
+
+// number of pieces of each (unpromoted) type in a game
+constexpr int PIECE_COUNT[NUM_UNPROMOTED_PIECE_TYPES] = {2, 4, 4, 4, 4, 2, 2, 18};
+constexpr int PACKED_BITS = 8 * sizeof(PackedSfen);
+
+
+class BitWriter {
+    public:
+        BitWriter(uint8_t* data) : data(data) {}
+
+        void write(uint32_t value, int bits) {
+            for (int i = 0; i < bits; ++i, ++pos) {
+                assert(pos < PACKED_BITS);
+                data[pos / 8] |= ((value >> i) & 1) << (pos % 8);
+            }
+        }
+
+    private:
+        uint8_t* data;
+        int pos = 0;
+};
+
+
+class BitReader {
+    public:
+        BitReader(const uint8_t* data) : data(data) {}
+
+        // reading past the end returns 0 bits and sets overflow
+        int read_bit() {
+            if (pos >= PACKED_BITS) {
+                overflow = true;
+                return 0;
+            }
+            int bit = (data[pos / 8] >> (pos % 8)) & 1;
+            ++pos;
+            return bit;
+        }
+
+        uint32_t read(int bits) {
+            uint32_t value = 0;
+            for (int i = 0; i < bits; ++i)
+                value |= read_bit() << i;
+            return value;
+        }
+
+        PieceType read_piece_type() {
+            uint32_t code = 0;
+            for (int bits = 1; bits <= 5; ++bits) {
+                code |= read_bit() << (bits - 1);
+                for (PieceType pt = GOLD; pt < NUM_UNPROMOTED_PIECE_TYPES; ++pt)
+                    if (PieceCodes[pt].bits == bits && PieceCodes[pt].code == code)
+                        return pt;
+            }
+            return NO_PIECE_TYPE;
+        }
+
+        bool overflow = false;
+
+    private:
+        const uint8_t* data;
+        int pos = 0;
+};
+
+
+PackedSfen pack_sfen(const Position& pos) {
+    PackedSfen packed;
+    std::memset(packed.data, 0, sizeof(packed.data));
+    BitWriter writer(packed.data);
+
+    writer.write(pos.side_to_move(), 1);
+    writer.write(pos.king_square(BLACK), 7);
+    writer.write(pos.king_square(WHITE), 7);
+
+    for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq) {
+        Piece p = pos.piece(sq);
+        if (p == NO_PIECE) {
+            writer.write(0, 1);
+            continue;
+        }
+
+        PieceType pt = type_of(p);
+        if (pt == KING)
+            continue;
+
+        const HuffmanCode& hc = PieceCodes[unpromoted_type(pt)];
+        writer.write(1, 1);
+        writer.write(hc.code, hc.bits);
+        if (can_promote(unpromoted_type(pt)))
+            writer.write(is_promoted(pt), 1);
+        writer.write(color_of(p), 1);
+    }
+
+    for (Color c = BLACK; c < NUM_COLORS; ++c) {
+        for (PieceType pt = GOLD; pt < NUM_UNPROMOTED_PIECE_TYPES; ++pt) {
+            for (int count = 0; count < pos.hand_count(c, pt); ++count) {
+                writer.write(PieceCodes[pt].code, PieceCodes[pt].bits);
+                writer.write(c, 1);
+            }
+        }
+    }
+
+    return packed;
+}
+
+
+PackedFileHeader packed_file_header() {
+    PackedFileHeader header = {};
+    std::memcpy(header.magic, PACKED_FILE_MAGIC, sizeof(PACKED_FILE_MAGIC));
+    header.version = PACKED_FILE_VERSION;
+    header.recordSize = sizeof(PackedSample);
+    return header;
+}
+
+
+const PackedSample* packed_records(const char* data, size_t size, size_t& numRecords) {
+    PackedFileHeader header;
+    if (size < sizeof(header))
+        return nullptr;
+    std::memcpy(&header, data, sizeof(header));
+
+    if (std::memcmp(header.magic, PACKED_FILE_MAGIC, sizeof(PACKED_FILE_MAGIC)) != 0 ||
+        header.version != PACKED_FILE_VERSION ||
+        header.recordSize != sizeof(PackedSample) ||
+        (size - sizeof(header)) % sizeof(PackedSample) != 0)
+        return nullptr;
+
+    numRecords = (size - sizeof(header)) / sizeof(PackedSample);
+    return reinterpret_cast<const PackedSample*>(data + sizeof(header));
+}
+
+
+bool unpack_sfen(const PackedSfen& packed, SfenBoard& board) {
+    BitReader reader(packed.data);
+    board.board.fill(NO_PIECE);
+    std::memset(board.hands, 0, sizeof(board.hands));
+
+    board.sideToMove = Color(reader.read(1));
+    Square blackKing = Square(reader.read(7));
+    Square whiteKing = Square(reader.read(7));
+    if (blackKing >= NUM_SQUARES || whiteKing >= NUM_SQUARES || blackKing == whiteKing)
+        return false;
+    board.board[blackKing] = make_piece(BLACK, KING);
+    board.board[whiteKing] = make_piece(WHITE, KING);
+    board.kingSq[BLACK] = blackKing;
+    board.kingSq[WHITE] = whiteKing;
+
+    int numPieces = 0;
+    int counts[NUM_UNPROMOTED_PIECE_TYPES] = {};
+    for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq) {
+        if (sq == blackKing || sq == whiteKing || reader.read_bit() == 0)
+            continue;
+
+        PieceType pt = reader.read_piece_type();
+        // the counts also bound the pieces on the board to NUM_PACKED_PIECES
+        if (pt == NO_PIECE_TYPE || ++counts[pt] > PIECE_COUNT[pt])
+            return false;
+        if (can_promote(pt) && reader.read_bit())
+            pt = promote(pt);
+        board.board[sq] = make_piece(Color(reader.read_bit()), pt);
+        ++numPieces;
+    }
+
+    // the pieces that are not on the board are in the hands
+    for (; numPieces < NUM_PACKED_PIECES; ++numPieces) {
+        PieceType pt = reader.read_piece_type();
+        if (pt == NO_PIECE_TYPE || ++counts[pt] > PIECE_COUNT[pt])
+            return false;
+        board.hands[reader.read_bit()][pt]++;
+    }
+
+    return !reader.overflow;
+}
+
+
+bool unpack_sfen(const PackedSfen& packed, Position& pos, int moveCount) {
+    SfenBoard board;
+    if (!unpack_sfen(packed, board))
+        return false;
+    pos.set(board.board, board.hands, board.sideToMove, moveCount);
+    return true;
+}
+
+
+} // namespace NNUE
+} // namespace harukashogi
\ No newline at end of file
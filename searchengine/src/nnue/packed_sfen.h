@@ -0,0 +1,79 @@
+#ifndef PACKED_SFEN_H
+#define PACKED_SFEN_H
+
+#include <cstdint>
+#include <array>
+
+#include "../types.h"
+#include "../position.h"
+
+namespace harukashogi {
+namespace NNUE {
+
+
+// position packed in 256 bits:
+// - side to move (1 bit) and the squares of the two kings (7 bits each)
+// - the other squares in order: 0 for an empty square, else 1, the prefix code of the piece
+//   type, the promotion bit (pieces that can promote) and the color bit
+// - the hand pieces one by one: the prefix code of the piece type and the color bit
+// a piece in hand costs at most as much as the same piece on the board (with the empty square
+// it leaves), so the 40 pieces always fit: the worst case is all of them on the board.
+struct PackedSfen {
+    uint8_t data[32];
+
+    Color side_to_move() const { return Color(data[0] & 1); }
+};
+
+
+// record of the training data files (.bin), written by gensfen
+struct PackedSample {
+    PackedSfen sfen;
+    // search score and game result (1 win, 0 draw, -1 loss) from the side to move's view
+    int16_t score;
+    uint16_t ply;
+    int8_t result;
+    uint8_t padding[3];
+};
+static_assert(sizeof(PackedSample) == 40, "PackedSample is stored as is in the data files");
+
+
+// header at the start of the training data files, followed by the records
+struct PackedFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+};
+
+constexpr char PACKED_FILE_MAGIC[8] = {'H', 'A', 'R', 'U', 'K', 'A', 'P', 'S'};
+// needs to be increased every time the record format changes
+constexpr uint32_t PACKED_FILE_VERSION = 1;
+
+PackedFileHeader packed_file_header();
+// records of a data file read in memory (e.g. mapped), nullptr if the header is not the one of
+// packed_file_header or if the file is truncated
+const PackedSample* packed_records(const char* data, size_t size, size_t& numRecords);
+
+
+// plain board description, filled in without building a Position
+struct SfenBoard {
+    std::array<Piece, NUM_SQUARES> board;
+    uint8_t hands[NUM_COLORS][NUM_UNPROMOTED_PIECE_TYPES];
+    Square kingSq[NUM_COLORS];
+    Color sideToMove;
+};
+
+
+PackedSfen pack_sfen(const Position& pos);
+// the packed sfens are read from files, they are checked while unpacking: returns false if the
+// kings are not on the board, if there are more pieces of a type than in a game or if the
+// pieces don't fit in the 256 bits. board (or pos) is not valid then
+bool unpack_sfen(const PackedSfen& packed, SfenBoard& board);
+// moveCount is not stored in the packed sfen, for a sample it is ply + 1 (ply is the 0-based
+// game ply, see Position::get_move_count)
+bool unpack_sfen(const PackedSfen& packed, Position& pos, int moveCount = 1);
+
+
+} // namespace NNUE
+} // namespace harukashogi
+
+#endif // PACKED_SFEN_H
\ No newline at end of file
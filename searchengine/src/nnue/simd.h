@@ -0,0 +1,169 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX512BW__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace harukashogi {
+namespace NNUE {
+
+
+// thin wrappers around the widest integer vector instructions available at compile time
+// (selected by the -march flags). Code using them must keep a scalar fallback for when
+// USE_SIMD is not defined, or when the layer size is not a multiple of the vector width.
+//
+// vec_packus_16: clamps two vectors of int16 to [0, 127] and packs them into one int8 vector,
+//                keeping the order of the elements (a then b).
+// vec_dpbusd_32: for each int32 lane, adds to acc the dot product of 4 unsigned 8 bit values
+//                of a with 4 signed 8 bit values of b. a must be in [0, 127], so that the 16 bit
+//                intermediate sums of the non VNNI versions can't saturate.
+// vec_reduce_32: horizontal sum of the int32 lanes.
+#if defined(__AVX2__)
+// horizontal sum of the int32 lanes of a 256 bit vector (also used for the halves of a 512 bit one)
+inline int32_t reduce_add_256_32(__m256i v) {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0b01001110));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0b10110001));
+    return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+#if defined(__AVX512BW__)
+
+#define USE_SIMD
+using vec_t = __m512i;
+constexpr size_t SIMD_WIDTH = 64;   // bytes in a vector
+constexpr size_t NUM_REGISTERS = 16; // registers used to keep a slice of the accumulator
+
+inline vec_t vec_load(const void* p) { return _mm512_loadu_si512(p); }
+inline void vec_store(void* p, vec_t v) { _mm512_storeu_si512(p, v); }
+inline vec_t vec_add_16(vec_t a, vec_t b) { return _mm512_add_epi16(a, b); }
+inline vec_t vec_sub_16(vec_t a, vec_t b) { return _mm512_sub_epi16(a, b); }
+inline vec_t vec_zero() { return _mm512_setzero_si512(); }
+inline vec_t vec_set1_32(int32_t x) { return _mm512_set1_epi32(x); }
+inline vec_t vec_add_32(vec_t a, vec_t b) { return _mm512_add_epi32(a, b); }
+
+inline vec_t vec_packus_16(vec_t a, vec_t b) {
+    vec_t packed = _mm512_packs_epi16(_mm512_max_epi16(a, vec_zero()),
+                                      _mm512_max_epi16(b, vec_zero()));
+    // packs works inside each 128 bit lane, restore the order of the 64 bit blocks
+    // (the zero masked forms, here and in vec_reduce_32, compile to the same instructions but
+    // avoid the -Wmaybe-uninitialized false positives of the unmasked ones with GCC 12)
+    return _mm512_maskz_permutexvar_epi64(0xFF, _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), packed);
+}
+
+inline vec_t vec_dpbusd_32(vec_t acc, vec_t a, vec_t b) {
+#if defined(__AVX512VNNI__)
+    return _mm512_dpbusd_epi32(acc, a, b);
+#else
+    vec_t products = _mm512_madd_epi16(_mm512_maddubs_epi16(a, b), _mm512_set1_epi16(1));
+    return _mm512_add_epi32(acc, products);
+#endif
+}
+
+inline int32_t vec_reduce_32(vec_t v) {
+    return reduce_add_256_32(_mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xF, v, 0),
+                                              _mm512_maskz_extracti64x4_epi64(0xF, v, 1)));
+}
+
+// bit i set if the i-th int32 lane is not zero
+inline uint32_t vec_nz_mask_32(vec_t v) { return _mm512_test_epi32_mask(v, v); }
+
+#elif defined(__AVX2__)
+
+#define USE_SIMD
+using vec_t = __m256i;
+constexpr size_t SIMD_WIDTH = 32;
+constexpr size_t NUM_REGISTERS = 16;
+
+inline vec_t vec_load(const void* p) { return _mm256_loadu_si256((const __m256i*)p); }
+inline void vec_store(void* p, vec_t v) { _mm256_storeu_si256((__m256i*)p, v); }
+inline vec_t vec_add_16(vec_t a, vec_t b) { return _mm256_add_epi16(a, b); }
+inline vec_t vec_sub_16(vec_t a, vec_t b) { return _mm256_sub_epi16(a, b); }
+inline vec_t vec_zero() { return _mm256_setzero_si256(); }
+inline vec_t vec_set1_32(int32_t x) { return _mm256_set1_epi32(x); }
+inline vec_t vec_add_32(vec_t a, vec_t b) { return _mm256_add_epi32(a, b); }
+
+inline vec_t vec_packus_16(vec_t a, vec_t b) {
+    vec_t packed = _mm256_packs_epi16(_mm256_max_epi16(a, vec_zero()),
+                                      _mm256_max_epi16(b, vec_zero()));
+    // packs works inside each 128 bit lane, restore the order of the 64 bit blocks
+    return _mm256_permute4x64_epi64(packed, 0b11011000);
+}
+
+inline vec_t vec_dpbusd_32(vec_t acc, vec_t a, vec_t b) {
+#if defined(__AVXVNNI__)
+    return _mm256_dpbusd_avx_epi32(acc, a, b);
+#else
+    vec_t products = _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), _mm256_set1_epi16(1));
+    return _mm256_add_epi32(acc, products);
+#endif
+}
+
+inline int32_t vec_reduce_32(vec_t v) { return reduce_add_256_32(v); }
+
+inline uint32_t vec_nz_mask_32(vec_t v) {
+    __m256i zero = _mm256_cmpeq_epi32(v, _mm256_setzero_si256());
+    return ~_mm256_movemask_ps(_mm256_castsi256_ps(zero)) & 0xFF;
+}
+
+#elif defined(__SSE2__)
+
+#define USE_SIMD
+using vec_t = __m128i;
+constexpr size_t SIMD_WIDTH = 16;
+constexpr size_t NUM_REGISTERS = 16;
+
+inline vec_t vec_load(const void* p) { return _mm_loadu_si128((const __m128i*)p); }
+inline void vec_store(void* p, vec_t v) { _mm_storeu_si128((__m128i*)p, v); }
+inline vec_t vec_add_16(vec_t a, vec_t b) { return _mm_add_epi16(a, b); }
+inline vec_t vec_sub_16(vec_t a, vec_t b) { return _mm_sub_epi16(a, b); }
+inline vec_t vec_zero() { return _mm_setzero_si128(); }
+inline vec_t vec_set1_32(int32_t x) { return _mm_set1_epi32(x); }
+inline vec_t vec_add_32(vec_t a, vec_t b) { return _mm_add_epi32(a, b); }
+
+inline vec_t vec_packus_16(vec_t a, vec_t b) {
+    return _mm_packs_epi16(_mm_max_epi16(a, vec_zero()), _mm_max_epi16(b, vec_zero()));
+}
+
+inline vec_t vec_dpbusd_32(vec_t acc, vec_t a, vec_t b) {
+#if defined(__SSSE3__)
+    vec_t products = _mm_madd_epi16(_mm_maddubs_epi16(a, b), _mm_set1_epi16(1));
+#else
+    // plain SSE2: widen to 16 bits (a is zero extended, b sign extended) and use madd,
+    // then add the pairs of adjacent sums so that each lane holds its own 4 products
+    vec_t bSign = _mm_cmpgt_epi8(vec_zero(), b);
+    __m128 lo = _mm_castsi128_ps(
+        _mm_madd_epi16(_mm_unpacklo_epi8(a, vec_zero()), _mm_unpacklo_epi8(b, bSign)));
+    __m128 hi = _mm_castsi128_ps(
+        _mm_madd_epi16(_mm_unpackhi_epi8(a, vec_zero()), _mm_unpackhi_epi8(b, bSign)));
+    vec_t products = _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)))
+    );
+#endif
+    return _mm_add_epi32(acc, products);
+}
+
+inline int32_t vec_reduce_32(vec_t v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0b01001110));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0b10110001));
+    return _mm_cvtsi128_si32(v);
+}
+
+inline uint32_t vec_nz_mask_32(vec_t v) {
+    __m128i zero = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+    return ~_mm_movemask_ps(_mm_castsi128_ps(zero)) & 0xF;
+}
+
+#endif
+
+
+} // namespace NNUE
+} // namespace harukashogi
+
+#endif // SIMD_H
@@ -14,7 +14,7 @@ INCBIN(OBEntry, Book, "../bin/book_data.bin");
 OpeningBook::OpeningBook() : size(gBookSize / sizeof(OBEntry)) {}
 
 
-Move OpeningBook::sample_move(uint64_t key) const {
+Move OpeningBook::sample_move(uint64_t key, std::mt19937& rng) const {
     const OBEntry* it = std::lower_bound(
         gBookData,
         gBookData + this->size,
@@ -31,7 +31,9 @@ class OpeningBook {
     public:
         OpeningBook();
 
-        Move sample_move(uint64_t key) const;
+        Move sample_move(uint64_t key) const { return sample_move(key, rng); }
+        // same as above, but with the caller's generator so the book can be shared between threads
+        Move sample_move(uint64_t key, std::mt19937& rng) const;
     
     private:
         mutable std::mt19937 rng{std::random_device{}()};
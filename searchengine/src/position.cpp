@@ -62,14 +62,7 @@ void Position::set(const std::string& sfenStr) {
 
     ss >> std::noskipws;
 
-    // empty board, hands, and bitboards
-    board.fill(NO_PIECE);
-    std::memset(hands, 0, sizeof(hands));
-    std::memset(pawnFiles, 0, sizeof(pawnFiles));
-    std::fill(std::begin(allPiecesBB), std::end(allPiecesBB), Bitboard(0));
-    std::memset(piecesBB, 0, sizeof(piecesBB));
-    gameStatus = NO_STATUS;
-    winner = NO_COLOR;
+    clear();
 
     // 1. board pieces
     while ((ss >> token) && token != ' ') {
@@ -112,6 +105,52 @@ void Position::set(const std::string& sfenStr) {
     ss >> std::skipws >> gamePly;
     gamePly--;
 
+    init_state();
+}
+
+
+void Position::set(const std::array<Piece, NUM_SQUARES>& pieces,
+                   const uint8_t handCounts[NUM_COLORS][NUM_UNPROMOTED_PIECE_TYPES],
+                   Color stm, int moveCount) {
+    clear();
+
+    for (Square sq = SQ_11; sq < NUM_SQUARES; ++sq) {
+        if (pieces[sq] == NO_PIECE)
+            continue;
+        add_piece(pieces[sq], sq);
+        if (type_of(pieces[sq]) == KING)
+            kingSq[color_of(pieces[sq])] = sq;
+        if (type_of(pieces[sq]) == PAWN)
+            pawnFiles[color_of(pieces[sq])][file_of(sq)] = true;
+    }
+
+    sideToMove = stm;
+
+    for (Color c = BLACK; c < NUM_COLORS; ++c)
+        for (PieceType pt = GOLD; pt < NUM_UNPROMOTED_PIECE_TYPES; ++pt)
+            for (int count = 0; count < handCounts[c][pt]; ++count)
+                add_hand_piece(c, pt);
+
+    gamePly = moveCount - 1;
+
+    init_state();
+}
+
+
+void Position::clear() {
+    // empty board, hands, and bitboards
+    board.fill(NO_PIECE);
+    std::memset(hands, 0, sizeof(hands));
+    numHandPieces = 0;
+    std::memset(pawnFiles, 0, sizeof(pawnFiles));
+    std::fill(std::begin(allPiecesBB), std::end(allPiecesBB), Bitboard(0));
+    std::memset(piecesBB, 0, sizeof(piecesBB));
+    gameStatus = NO_STATUS;
+    winner = NO_COLOR;
+}
+
+
+void Position::init_state() {
     // initialize the state info list
     si.clear();
     si.push_front(StateInfo());
@@ -376,6 +415,33 @@ void Position::make_move(Move m) {
 }
 
 
+// computes the zobrist key of the position after the given move, without making it.
+// mirrors the key updates of make_move, used to prefetch the transposition table.
+uint64_t Position::key_after(Move m) const {
+    uint64_t key = si.front().key ^ Zobrist::sideToMoveKey;
+
+    if (m.is_drop()) {
+        PieceType pt = m.dropped();
+        key ^= Zobrist::handKeys[sideToMove][pt][hands[sideToMove][pt] - 1];
+        key ^= Zobrist::boardKeys[m.to()][make_piece(sideToMove, pt)];
+    }
+    else {
+        Piece p = board[m.from()];
+        key ^= Zobrist::boardKeys[m.from()][p];
+
+        if (board[m.to()] != NO_PIECE) {
+            PieceType capturedPT = unpromoted_type(type_of(board[m.to()]));
+            key ^= Zobrist::boardKeys[m.to()][board[m.to()]];
+            key ^= Zobrist::handKeys[sideToMove][capturedPT][hands[sideToMove][capturedPT]];
+        }
+
+        key ^= Zobrist::boardKeys[m.to()][m.is_promotion() ? promote_piece(p) : p];
+    }
+
+    return key;
+}
+
+
 // undoes the given move.
 // the move is assumed to be legal.
 void Position::unmake_move(Move m) {
@@ -707,11 +773,13 @@ void Position::move_piece(Square from, Square to) {
 
 void Position::add_hand_piece(Color color, PieceType pt) {
     hands[color][pt]++;
+    numHandPieces++;
 }
 
 
 void Position::remove_hand_piece(Color color, PieceType pt) {
     hands[color][pt]--;
+    numHandPieces--;
 }
 
 
@@ -86,6 +86,11 @@ class Position {
 			sfenStr = "lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1"
 		);
 		std::string sfen() const;
+		// sets the position from the pieces on each square and the hand counts, used by decoders
+		// that don't go through SFEN strings. moveCount is the full move count as in the SFEN
+		void set(const std::array<Piece, NUM_SQUARES>& pieces,
+				 const uint8_t handCounts[NUM_COLORS][NUM_UNPROMOTED_PIECE_TYPES],
+				 Color stm, int moveCount = 1);
 
 		// move methods
 		void make_move(Move m);
@@ -139,6 +144,8 @@ class Position {
 		int hand_count(Color color, PieceType pt) const {
 			return hands[color][pt];
 		}
+		// total number of pieces in both hands
+		int hand_pieces() const { return numHandPieces; }
 		Color side_to_move() const { return sideToMove; }
 		bool pawn_on_file(Color color, File file) const { 
 			return pawnFiles[color][file];
@@ -146,6 +153,8 @@ class Position {
 		Color get_winner() const;
 		int get_move_count() const { return gamePly; }
 		uint64_t get_key() const { return si.front().key; }
+		// zobrist key of the position after the given move, without making the move
+		uint64_t key_after(Move m) const;
 
 		Bitboard all_pieces(Color color) const { return allPiecesBB[color]; }
 		Bitboard all_pieces() const { return allPiecesBB[BLACK] | allPiecesBB[WHITE]; }
@@ -164,6 +173,10 @@ class Position {
 		
 	private:
 
+		// empties the board and the hands, and computes the state info once the pieces are set
+		void clear();
+		void init_state();
+
 		// methods to update all the affected information when a piece moves
 		void add_piece(Piece p, Square sq);
 		void remove_piece(Square sq);
@@ -186,6 +199,7 @@ class Position {
 		// data members
 		std::array<Piece, NUM_SQUARES> board;
 		uint8_t hands[NUM_COLORS][NUM_UNPROMOTED_PIECE_TYPES] = {};
+		int numHandPieces = 0;
 
 		// bitboards
 		Bitboard allPiecesBB[NUM_COLORS] = {};
@@ -86,8 +86,10 @@ void Worker::search() {
 
         // don't output the best move if stopping a pondering search
         const Worker& bestThread = get_best_thread();
-        outputManager.on_iter(bestThread.info);
-        outputManager.on_best_move(bestThread.info.pv[0], bestThread.info.pv[1]);
+        SearchInfo bestInfo = bestThread.info;
+        bestInfo.hashfull = tt.hashfull();
+        outputManager.on_iter(bestInfo);
+        outputManager.on_best_move(bestInfo.pv[0], bestInfo.pv[1]);
     }
 }
 
@@ -171,7 +173,14 @@ void Worker::iterative_deepening() {
 
         // the master thread outputs the search info
         if (is_master()) {
+            info.hashfull = tt.hashfull();
             outputManager.on_iter(info);
+
+            // depth limit reached, stop the slaves as well
+            if (limits.depth > 0 && depth >= limits.depth) {
+                threads.abort_search();
+                break;
+            }
         }
     }
 }
@@ -193,7 +202,7 @@ int Worker::search(StackEntry* stack, int depth, int alpha, int beta) {
     constexpr NodeType nodeType = searchType == ROOT_NODE ? PV_NODE : searchType;
 
     // probe the transposition table for an entry
-    std::tuple<bool, TTData, TTWriter> result = tt.probe(searchPos.get_key());
+    std::tuple<bool, TTData, TTWriter> result = tt.probe(searchPos.get_key(), ttStats);
     bool ttHit = std::get<0>(result);
     TTData ttData = std::get<1>(result);
     TTWriter ttWriter = std::get<2>(result);
@@ -263,6 +272,12 @@ int Worker::search(StackEntry* stack, int depth, int alpha, int beta) {
         else reduction = 1;
         
         searchDepth = depth - reduction;
+
+        // start loading the child's cluster from memory, the latency is hidden by the
+        // accumulator update and the move making
+        // (with a depth of 1 the child is a q_search node, which doesn't probe the table)
+        if (depth > 1)
+            tt.prefetch(searchPos.key_after(m));
         
         make_move(m);
         // Princpal Variation Search (PVS)
@@ -338,7 +353,7 @@ int Worker::q_search(int ply, int alpha, int beta) {
         throw AbortSearchException();
 
     // int eval = evaluate(searchPos);
-    int eval = evaluate_nnue(nnue, accumulatorStack.top(), searchPos);
+    int eval = evaluate_nnue(nnue, accumulatorStack, searchPos, evalCache);
 
     if (eval >= beta)
         return eval;
@@ -377,8 +392,8 @@ int Worker::q_search(int ply, int alpha, int beta) {
 
 
 void Worker::make_move(Move m) {
-    // update the nnue accumulator (before making the move)
-    // copy the accumulator and update it
+    // record the changes of the nnue accumulator (before making the move)
+    // the accumulator is only updated when the position is evaluated
     accumulatorStack.push(searchPos, m);
     // make the move
     searchPos.make_move(m);
@@ -394,8 +409,7 @@ void Worker::unmake_move(Move m) {
 
 
 void Worker::make_null_move() {
-    // add a copy of the top accumulator to the stack
-    // no modifications are made to the accumulator with a null move
+    // add an accumulator with no changes to the stack
     accumulatorStack.push();
     // make the null move
     searchPos.make_null_move();
@@ -427,10 +441,9 @@ void Worker::stop_check() {
         stopTime = chr::steady_clock::now() + searchTime;
     }
 
-    if (limits.nodes > 0 && info.nodeCount >= limits.nodes) {
-        std::cout << "nodes limit reached" << std::endl;
-        std::cout << "node count:  " << info.nodeCount << std::endl;
-        std::cout << "nodes limit: " << limits.nodes << std::endl;
+    // nodes limit, counted on the master thread. the first iteration is always completed so
+    // that there is a best move even with a very small limit
+    if (limits.nodes > 0 && info.nodeCount >= limits.nodes && info.depth > 0) {
         threads.abort_search();
         throw AbortSearchException();
     }
@@ -37,6 +37,8 @@ struct SearchInfo {
     int eval = 0;
     int depth = 0;
     uint64_t nodeCount = 0;
+    // transposition table usage in permille, filled in by the master thread
+    int hashfull = 0;
     chr::time_point<chr::steady_clock> startTime = chr::steady_clock::now();
 };
 
@@ -82,11 +84,11 @@ class Worker : public Thread {
         Worker(size_t id, TTable& tt, ThreadPool<Worker>& threads, OutputManager& outputManager,
                NNUE::NNUE& nnue) : 
             Thread(id),
+            nnue(nnue),
+            accumulatorStack(nnue),
             tt(tt),
             threads(threads),
-            outputManager(outputManager),
-            nnue(nnue),
-            accumulatorStack(nnue.feature_transformer()) {
+            outputManager(outputManager) {
             clear();
         }
 
@@ -96,6 +98,12 @@ class Worker : public Thread {
 
         // clears the move histories, usually called when starting a new game
         void clear();
+        // rebuilds the accumulator stack (the accumulator size can change) and clears the
+        // eval cache, called when the network changes
+        void reset_nnue() {
+            evalCache.clear();
+            accumulatorStack.reset(nnue);
+        }
 
         // master thread only
         void set_limits(const SearchLimits& limits) {
@@ -118,6 +126,10 @@ class Worker : public Thread {
             this->moveOverhead = chr::milliseconds(overhead);
         }
 
+        // stats of this thread's transposition table probes
+        const TTStats& tt_stats() const { return ttStats; }
+        const EvalCache& eval_cache() const { return evalCache; }
+
         // struct containing the results and stats of the search
         SearchInfo info;
     private:
@@ -151,11 +163,14 @@ class Worker : public Thread {
         StackEntry stack[MAX_DEPTH];
         void empty_stack();
 
-        NNUE::NNUE nnue;
+        // shared by all the threads, only changed when no search is running
+        NNUE::NNUE& nnue;
         NNUE::AccumulatorStack accumulatorStack;
+        EvalCache evalCache;
 
         // shared elements
         TTable& tt;
+        TTStats ttStats;
 
         // only used by the master thread
         // horrendous but necessary to access the thread pool from the master thread
@@ -1,20 +1,119 @@
 #include <iostream>
+#include <fstream>
+#include <random>
+#include <cstring>
+#include <filesystem>
 
 
 #include "nnue/nnue.h"
+#include "nnue/load.h"
+#include "nnue/packed_sfen.h"
 #include "engine.h"
+#include "ttable.h"
 
 
 using namespace harukashogi;
 
+
+// a key that differs from a stored one only in bits 16-31 (same cluster, same low 16 bits)
+// must not hit the entry
+bool test_tt_near_collision() {
+    TTable tt;
+    tt.resize(1);
+    TTStats stats;
+
+    uint64_t key = 0x123456789abcdef0ULL;
+    auto [hit, data, writer] = tt.probe(key, stats);
+    writer.write(key, 100, Move::null(), 10, PV_ENTRY);
+
+    bool stored = std::get<0>(tt.probe(key, stats));
+    bool rejected = !std::get<0>(tt.probe(key ^ (1ULL << 20), stats));
+    return stored && rejected;
+}
+
+
+// packed records that are not valid (corrupt or foreign data) are rejected by unpack_sfen and
+// skipped by the loader, a file without the header is rejected
+bool test_corrupt_packed_records() {
+    Position pos;
+    pos.set();
+    NNUE::PackedSfen valid = NNUE::pack_sfen(pos);
+    NNUE::SfenBoard board;
+    if (!NNUE::unpack_sfen(valid, board))
+        return false;
+
+    std::vector<NNUE::PackedSfen> corrupt;
+    // black king on square 127
+    corrupt.push_back(valid);
+    corrupt.back().data[0] |= 0xFE;
+    // every square after the kings holds a rook
+    corrupt.push_back(valid);
+    std::memset(corrupt.back().data + 2, 0xFF, sizeof(valid.data) - 2);
+    // empty board, 38 pawns in the black hand
+    corrupt.push_back(valid);
+    std::memset(corrupt.back().data + 2, 0, sizeof(valid.data) - 2);
+    for (const auto& packed : corrupt)
+        if (NNUE::unpack_sfen(packed, board))
+            return false;
+
+    // random records, with a valid one first
+    std::mt19937_64 rng(1);
+    std::vector<NNUE::PackedSample> records(1000);
+    for (auto& record : records)
+        for (auto& byte : record.sfen.data)
+            byte = uint8_t(rng());
+    records[0].sfen = valid;
+    for (size_t i = 0; i < corrupt.size(); ++i)
+        records[i + 1].sfen = corrupt[i];
+
+    std::string path = (std::filesystem::temp_directory_path() / "harukashogi_test.bin").string();
+    {
+        std::ofstream file(path, std::ios::binary);
+        NNUE::PackedFileHeader header = NNUE::packed_file_header();
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(records.data()),
+                   records.size() * sizeof(NNUE::PackedSample));
+    }
+    auto batch = NNUE::load_data_batch(path);
+    bool ok = batch->batch_size >= 1 && batch->skipped >= corrupt.size()
+           && batch->batch_size + batch->skipped == records.size();
+
+    // the records alone, without the header
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(records.data()),
+                   records.size() * sizeof(NNUE::PackedSample));
+    }
+    try {
+        NNUE::load_data_batch(path);
+        ok = false;
+    } catch (const std::runtime_error&) {}
+
+    std::filesystem::remove(path);
+    return ok;
+}
+
+
 int main() {
     init();
 
+    bool ok = true;
+    if (!test_tt_near_collision()) {
+        std::cout << "FAILED: TT near collision" << std::endl;
+        ok = false;
+    }
+    if (!test_corrupt_packed_records()) {
+        std::cout << "FAILED: corrupt packed records" << std::endl;
+        ok = false;
+    }
+
     Position pos;
     NNUE::NNUE nnue;
 
     pos.set("ln4k1l/4g2s1/3s1pnp1/3pp1P1p/P1PP1P3/2p1S2RP/1+r2P4/L3+n4/1+p2K2NL w BGSPPbggpp 1");
-    NNUE::AccumulatorType acc;
-    nnue.feature_transformer().forward(pos, acc);
-    std::cout << nnue.evaluate(acc, pos.side_to_move()) << std::endl;
+    NNUE::AccumulatorStack accStack(nnue);
+    accStack.compute(pos);
+    std::cout << nnue.evaluate(accStack, pos) << std::endl;
+
+    return ok ? 0 : 1;
 }
\ No newline at end of file
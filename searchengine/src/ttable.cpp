@@ -1,75 +1,135 @@
 #include <iostream>
 #include <atomic>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
 
 #include "ttable.h"
+#include "misc.h"
 
 namespace harukashogi {
 
 
-constexpr uint8_t DEPTH_BITS = 6;
-constexpr uint8_t DEPTH_MASK = (1ull << DEPTH_BITS) - 1;
+// 6 bits for the generation, 0 is reserved for empty entries
+constexpr uint8_t NUM_GENERATIONS = 63;
+
+// layout of the packed data word of an entry
+// 16 bits score | 16 bits key (bits 16-31) | 16 bits best move | 8 bits depth
+// 2 bits node type | 6 bits generation
+constexpr int SCORE_SHIFT = 0;
+constexpr int KEY_SHIFT   = 16;
+constexpr int MOVE_SHIFT  = 32;
+constexpr int DEPTH_SHIFT = 48;
+constexpr int TYPE_SHIFT  = 56;
+constexpr int GEN_SHIFT   = 58;
+
+// in the replacement policy, one search of age is worth AGE_WEIGHT plies of depth
+constexpr int AGE_WEIGHT = 8;
 
-constexpr uint8_t NUM_GENERATIONS = 255;
 
 // an entry in the transposition table
-// 80 bits, 10 bytes in total
-struct TTEntry {
-    uint16_t key_low;
-    uint16_t key_high;
-    int16_t score;
-    Move bestMove;
-    // the first 6 bits are for the depth
-    // the last 2 bits are for the node type
-    uint8_t depthAndNodeType;
-    // the generation is a number between 1 and 255
-    // this is because 0 is reserved for empty entries
-    uint8_t generation8;
+// 80 bits, 10 bytes in total: a 64-bit data word and a 16-bit key check, kept in separate
+// arrays of the cluster so that both are naturally aligned.
+// 32 bits of the key are verified: bits 16-31 are stored in the data word and the key check
+// holds bits 0-15. The cluster index already depends on the high bits of the key.
+// The entries are shared by all the search threads without any locking, so a write from one
+// thread can interleave with a read (or another write) from a different thread.
+// To detect torn entries, the key check is folded with the data word: if the two don't belong
+// to the same write, the check fails (except for a 1 in 65536 chance) and the entry is treated
+// as a miss. Each word is accessed atomically (relaxed ordering, plain movs on x86).
+constexpr size_t CLUSTER_SIZE = 6;
+
+// 64 bytes for each cluster, exactly one cache line
+// (aligned so that a probe never touches more than one line).
+// 6 entries per 64 bytes, the same number of entries per MB as 3 entries of 32 byte clusters
+struct alignas(64) Cluster {
+    std::atomic<uint64_t> data[CLUSTER_SIZE];
+    std::atomic<uint16_t> keys[CLUSTER_SIZE];
+    uint16_t padding[2];
+};
+
+static_assert(sizeof(Cluster) == 64, "Cluster must be one cache line");
+
+
+namespace TTEntry {
 
-    TTData read() const {
-        return TTData(score, bestMove, depthAndNodeType & DEPTH_MASK,
-                      TTEntryType(depthAndNodeType >> DEPTH_BITS));
+    // key check stored with the data word d
+    uint16_t check(uint64_t key, uint64_t d) {
+        return uint16_t(key ^ d ^ (d >> 16) ^ (d >> 32) ^ (d >> 48));
     }
 
-    void write(uint64_t key, int16_t score, Move bestMove, uint8_t depth, TTEntryType type,
-               int generation) {
-        this->key_low = uint16_t(key);
-        this->key_high = uint16_t(key >> 16);
-        this->score = score;
-        this->bestMove = bestMove;
-        this->depthAndNodeType = (depth & DEPTH_MASK) | (uint8_t(type) << DEPTH_BITS);
-        this->generation8 = generation % NUM_GENERATIONS + 1;
+    // loads the data word of an entry. 0 is reserved for empty entries
+    // (every written entry has a generation between 1 and NUM_GENERATIONS)
+    uint64_t load(const Cluster& cluster, size_t i) {
+        return cluster.data[i].load(std::memory_order_relaxed);
     }
 
-    bool matches(uint64_t key) const {
-        return key_low == uint16_t(key) && key_high == uint16_t(key >> 16);
+    // checks that the data word loaded from an entry was written together with the given key
+    bool matches(const Cluster& cluster, size_t i, uint64_t key, uint64_t d) {
+        return uint16_t(d >> KEY_SHIFT) == uint16_t(key >> 16)
+            && cluster.keys[i].load(std::memory_order_relaxed) == check(key, d);
     }
 
-    bool is_empty() const {
-        return !depthAndNodeType;
+    void write(Cluster& cluster, size_t i, uint64_t key, int16_t score, Move bestMove,
+               uint8_t depth, TTEntryType type, uint8_t generation) {
+        uint64_t d = uint64_t(uint16_t(score))     << SCORE_SHIFT
+                   | uint64_t(uint16_t(key >> 16)) << KEY_SHIFT
+                   | uint64_t(bestMove.raw())      << MOVE_SHIFT
+                   | uint64_t(depth)               << DEPTH_SHIFT
+                   | uint64_t(type)                << TYPE_SHIFT
+                   | uint64_t(generation)          << GEN_SHIFT;
+        cluster.keys[i].store(check(key, d), std::memory_order_relaxed);
+        cluster.data[i].store(d, std::memory_order_relaxed);
     }
-};
 
+    TTData read(uint64_t d) {
+        return TTData(int16_t(d >> SCORE_SHIFT), Move(uint16_t(d >> MOVE_SHIFT)),
+                      uint8_t(d >> DEPTH_SHIFT), TTEntryType((d >> TYPE_SHIFT) & 0x3));
+    }
 
-constexpr size_t CLUSTER_SIZE = 3;
+    uint8_t depth(uint64_t d) { return uint8_t(d >> DEPTH_SHIFT); }
+    uint8_t generation8(uint64_t d) { return uint8_t(d >> GEN_SHIFT); }
 
-// 32 bytes for each cluster
-// (efficiently aligned for cache lines)
-struct Cluster {
-    TTEntry entries[CLUSTER_SIZE];
-    char padding[32 - sizeof(TTEntry) * CLUSTER_SIZE];
-};
+} // namespace TTEntry
 
 
 void TTWriter::write(uint64_t key, int16_t score, Move bestMove, uint8_t depth, TTEntryType type) {
-    entry->write(key, score, bestMove, depth, type, gen8);
+    TTEntry::write(*cluster, slot, key, score, bestMove, depth, type, gen8);
 }
 
 
 // resize the transposition table to the given size in MB
-void TTable::resize(size_t size) {
+void TTable::resize(size_t size, size_t numThreads) {
+    free_table();
+
     size_t numClusters = size * 1024 * 1024 / sizeof(Cluster);
-    table = std::make_unique<Cluster[]>(numClusters);
+    table = static_cast<Cluster*>(large_pages_alloc(numClusters * sizeof(Cluster)));
     this->size = numClusters;
+
+    clear(numThreads);
+}
+
+
+void TTable::clear(size_t numThreads) {
+    numThreads = std::max(numThreads, size_t(1));
+    size_t stride = size / numThreads;
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; i++) {
+        threads.emplace_back([this, i, stride, numThreads]() {
+            size_t start = i * stride;
+            size_t len = i == numThreads - 1 ? size - start : stride;
+            std::memset(static_cast<void*>(table + start), 0, len * sizeof(Cluster));
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    generation8 = 1;
 }
 
 
@@ -77,60 +137,177 @@ TTable::TTable() {
     resize(16);
 }
 
-TTable::~TTable() = default;
+TTable::~TTable() {
+    free_table();
+}
+
+
+void TTable::free_table() {
+    if (mapped)
+        unmap_file(table, size * sizeof(Cluster));
+    else
+        large_pages_free(table);
+    table = nullptr;
+    mapped = false;
+}
 
 
 uint8_t TTable::relativeAge(uint8_t gen) const {
-    return gen > generation8 ? gen - NUM_GENERATIONS : gen;
+    return (generation8 + NUM_GENERATIONS - gen) % NUM_GENERATIONS;
 }
 
-std::tuple<bool, TTData, TTWriter> TTable::probe(uint64_t key) {
-    TTEntry* entries = table[index(key)].entries;
+std::tuple<bool, TTData, TTWriter> TTable::probe(uint64_t key, TTStats& stats) {
+    stats.probes++;
+
+    Cluster& cluster = table[index(key)];
+
+    // load every data word once, other threads can overwrite the entries at any time
+    uint64_t data[CLUSTER_SIZE];
+    for (size_t i = 0; i < CLUSTER_SIZE; i++)
+        data[i] = TTEntry::load(cluster, i);
 
     // loop through the cluster and 
     for (size_t i = 0; i < CLUSTER_SIZE; i++) {
-        if (entries[i].matches(key) && !entries[i].is_empty()) {
-            hits++;
-            return {true, entries[i].read(), TTWriter(&entries[i], generation8)};
+        if (data[i] && TTEntry::matches(cluster, i, key, data[i])) {
+            stats.hits++;
+            return {true, TTEntry::read(data[i]), TTWriter(&cluster, i, generation8)};
         }
     }
 
     // if no matching entry is found, decide which entry to replace and return it's pointer
-    // return the pointer to the oldest entry
-    TTEntry* replace = entries;
+    // deep entries are kept over shallow ones, but lose value with every search they get older:
+    // the entry with the lowest depth - AGE_WEIGHT * age is replaced
+    size_t replace = 0;
+    int replaceValue = INT32_MAX;
     for (size_t i = 0; i < CLUSTER_SIZE; i++) {
         // return the first empty entry
-        if (entries[i].is_empty())
-            return {false, TTData(), TTWriter(&entries[i], generation8)};
-        if (relativeAge(entries[i].generation8) < relativeAge(replace->generation8))
-            replace = &entries[i];
+        if (!data[i])
+            return {false, TTData(), TTWriter(&cluster, i, generation8)};
+
+        int value = TTEntry::depth(data[i])
+                  - AGE_WEIGHT * relativeAge(TTEntry::generation8(data[i]));
+        if (value < replaceValue) {
+            replace = i;
+            replaceValue = value;
+        }
     }
     
-    collisions++;
-    return {false, TTData(), TTWriter(replace, generation8)};
+    stats.collisions++;
+    return {false, TTData(), TTWriter(&cluster, replace, generation8)};
+}
+
+
+void TTable::prefetch(uint64_t key) const {
+    __builtin_prefetch(&table[index(key)]);
 }
 
 
 void TTable::new_search() {
-    generation8++;
-    if (generation8 == 0)
-        generation8 = 1;
+    // cycles between 1 and NUM_GENERATIONS
+    generation8 = generation8 % NUM_GENERATIONS + 1;
 }
 
 
-void TTable::print_stats() const {
+// number of clusters sampled by hashfull (1000 entries)
+constexpr size_t HASHFULL_SAMPLE = 1000 / CLUSTER_SIZE;
+
+int TTable::hashfull() const {
+    size_t sample = std::min(HASHFULL_SAMPLE, size);
     int count = 0;
-    for (size_t i = 0; i < size; i++) {
+    for (size_t i = 0; i < sample; i++) {
         for (size_t j = 0; j < CLUSTER_SIZE; j++) {
-            if (!table[i].entries[j].is_empty())
+            uint64_t d = TTEntry::load(table[i], j);
+            if (d && TTEntry::generation8(d) == generation8)
                 count++;
         }
     }
-    
+
+    return count * 1000 / (sample * CLUSTER_SIZE);
+}
+
+
+void TTable::print_stats(const TTStats& stats) const {
+    double hitRate = stats.probes ? 100.0 * stats.hits / stats.probes : 0.0;
+
     std::cout << "TT Size:    " << size * CLUSTER_SIZE << std::endl;
-    std::cout << "Occupied:   " << count << std::endl;
-    std::cout << "Hits:       " << hits << std::endl;
-    std::cout << "Collisions: " << collisions << std::endl;
+    std::cout << "Hashfull:   " << hashfull() << std::endl;
+    std::cout << "Probes:     " << stats.probes << std::endl;
+    std::cout << "Hits:       " << stats.hits << " (" << hitRate << "%)" << std::endl;
+    std::cout << "Collisions: " << stats.collisions << std::endl;
+}
+
+
+// header of a dumped table file
+// the clusters start at TT_FILE_DATA_OFFSET, so that they can be memory mapped (page aligned)
+struct TTFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t clusterBytes;
+    uint64_t numClusters;
+    uint8_t generation8;
+};
+
+constexpr char TT_FILE_MAGIC[8] = {'H', 'A', 'R', 'U', 'K', 'A', 'T', 'T'};
+// needs to be increased every time the entry format changes
+constexpr uint32_t TT_FILE_VERSION = 4;
+constexpr size_t TT_FILE_DATA_OFFSET = 4096;
+
+
+bool TTable::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    TTFileHeader header = {};
+    std::memcpy(header.magic, TT_FILE_MAGIC, sizeof(TT_FILE_MAGIC));
+    header.version = TT_FILE_VERSION;
+    header.clusterBytes = sizeof(Cluster);
+    header.numClusters = size;
+    header.generation8 = generation8;
+
+    char headerBlock[TT_FILE_DATA_OFFSET] = {};
+    std::memcpy(headerBlock, &header, sizeof(header));
+    file.write(headerBlock, sizeof(headerBlock));
+    file.write(reinterpret_cast<const char*>(table), size * sizeof(Cluster));
+
+    return file.good();
+}
+
+
+bool TTable::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    TTFileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+    file.close();
+
+    // reject files with a different format or table size
+    if (std::memcmp(header.magic, TT_FILE_MAGIC, sizeof(TT_FILE_MAGIC)) != 0 ||
+        header.version != TT_FILE_VERSION ||
+        header.clusterBytes != sizeof(Cluster) ||
+        header.numClusters != size)
+        return false;
+
+    // a truncated file would fault when accessing the missing pages
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) != TT_FILE_DATA_OFFSET + size * sizeof(Cluster))
+        return false;
+
+    void* mem = map_file(path, TT_FILE_DATA_OFFSET, size * sizeof(Cluster));
+    if (!mem)
+        return false;
+
+    size_t numClusters = size;
+    free_table();
+    table = static_cast<Cluster*>(mem);
+    size = numClusters;
+    mapped = true;
+    generation8 = header.generation8;
+
+    return true;
 }
 
 
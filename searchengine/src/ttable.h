@@ -1,7 +1,7 @@
 #ifndef TRANSPOSITION_H
 #define TRANSPOSITION_H
 
-#include <memory>
+#include <string>
 
 #include "types.h"
 
@@ -36,18 +36,36 @@ struct TTData {
 };
 
 
+// probe statistics of the transposition table.
+// every search thread counts its own probes, so the counters never share a cache line between
+// threads (the struct is padded to a full line). They are summed on demand.
+struct alignas(64) TTStats {
+    uint64_t probes = 0;
+    uint64_t hits = 0;
+    uint64_t collisions = 0;
+
+    TTStats& operator+=(const TTStats& other) {
+        probes += other.probes;
+        hits += other.hits;
+        collisions += other.collisions;
+        return *this;
+    }
+};
+
+
 struct Cluster;
-struct TTEntry;
 
 
 class TTWriter {
     public:
         void write(uint64_t key, int16_t score, Move bestMove, uint8_t depth, TTEntryType type);
 
-        TTWriter(TTEntry* entry, uint8_t gen8) : entry(entry), gen8(gen8) {}
+        TTWriter(Cluster* cluster, size_t slot, uint8_t gen8)
+            : cluster(cluster), slot(uint8_t(slot)), gen8(gen8) {}
     
     private:
-        TTEntry* entry;
+        Cluster* cluster;
+        uint8_t slot;
         uint8_t gen8;
 };
 
@@ -57,30 +75,54 @@ class TTable {
         TTable();
         ~TTable();
 
-        void resize(size_t size);
+        // resize the table to the given size in MB and clear it with numThreads threads
+        void resize(size_t size, size_t numThreads = 1);
+        // zeroes the table, splitting the work between numThreads threads.
+        // The memory pages are first touched by the clearing threads, so on NUMA systems they are
+        // spread over the nodes the threads run on.
+        void clear(size_t numThreads = 1);
 
         // probe the transposition table for an entry
         // returns a tuple with a boolean indicating if the entry was found
         // and a pointer to the entry.
         // If the entry was not found, the pointer is to the location for the new entry.
-        std::tuple<bool, TTData, TTWriter> probe(uint64_t key);
+        // The outcome of the probe is counted in the stats of the calling thread.
+        std::tuple<bool, TTData, TTWriter> probe(uint64_t key, TTStats& stats);
+
+        // prefetch the cluster of the given key into the cache, without waiting for it
+        void prefetch(uint64_t key) const;
 
         void new_search();
 
-        void print_stats() const;
+        // estimate of the table usage in permille, sampled from the first clusters.
+        // counts the entries written in the current search (as in the USI hashfull info)
+        int hashfull() const;
+
+        // prints the given stats (summed over the search threads) and the table usage
+        void print_stats(const TTStats& stats) const;
+
+        // dump the table to a file, so that it can be reloaded by a later engine process.
+        // returns false if the file can't be written.
+        bool save(const std::string& path) const;
+        // reload a table dumped by save, memory mapping the file in place of the current table.
+        // the file is rejected (returning false) if it was written with a different table size
+        // or entry format.
+        bool load(const std::string& path);
         
     private:
-        std::unique_ptr<Cluster[]> table;
+        Cluster* table = nullptr;
         size_t size;
+        // true if the table is a memory mapped file (loaded with load)
+        bool mapped = false;
+
+        void free_table();
 
         size_t index(uint64_t key) const;
+        // number of searches since the entry generation
         uint8_t relativeAge(uint8_t generation8) const;
 
-        uint8_t generation8 = 0;
-
-        // stats for the transposition table
-        uint hits = 0;
-        uint collisions = 0;
+        // generation of the current search, between 1 and NUM_GENERATIONS
+        uint8_t generation8 = 1;
 };
 
 
@@ -43,6 +43,15 @@ void USIEngine::run() {
         // else if (token == "gameover")
         //     gameover(cmdStream);
 
+        else if (token == "savehash")
+            savehash(cmdStream);
+
+        else if (token == "loadhash")
+            loadhash(cmdStream);
+
+        else if (token == "stats")
+            engine.print_stats();
+
         // unknown commands are ignored, as per the USI protocol
 
     } while (token != "quit");
@@ -54,10 +63,11 @@ void USIEngine::usi() {
               << "id author Fausto Lasca" << std::endl;
 
     // TODO: add options
-    std::cout << "option name USI_Hash type spin default 16 min 1 max 1024\n";
+    std::cout << "option name USI_Hash type spin default 16 min 1 max 1048576\n";
     std::cout << "option name Threads type spin default 1 min 1 max 128\n";
     std::cout << "option name MoveOverhead type spin default 0 min 0 max 2000\n";
     std::cout << "option name USI_OwnBook type check default true\n";
+    std::cout << "option name EvalFile type string default <empty>\n";
 
     std::cout << "usiok" << std::endl;
 }
@@ -81,6 +91,13 @@ void USIEngine::setoption(std::istringstream& cmdStream) {
                 engine.set_move_overhead(std::stoi(token));
             else if (name == "USI_OwnBook")
                 engine.set_own_book(token == "true");
+            else if (name == "EvalFile") {
+                // the path can contain spaces
+                std::string rest;
+                std::getline(cmdStream, rest);
+                token += rest;
+                engine.set_eval_file(token == "<empty>" ? "" : token);
+            }
             name.clear();
         }
     }
@@ -88,6 +105,10 @@ void USIEngine::setoption(std::istringstream& cmdStream) {
 
 
 void USIEngine::isready() {
+    // the network is loaded here, as loading can take time
+    if (!engine.load_eval_file())
+        std::cout << "info string failed to load the network file, using the embedded network"
+                  << std::endl;
     std::cout << "readyok" << std::endl;
 }
 
@@ -188,6 +209,29 @@ void USIEngine::ponderhit() {
 }
 
 
+void USIEngine::savehash(std::istringstream& cmdStream) {
+    std::string path;
+    std::getline(cmdStream >> std::ws, path);
+
+    if (engine.save_tt(path))
+        std::cout << "info string hash saved to " << path << std::endl;
+    else
+        std::cout << "info string failed to save hash to " << path << std::endl;
+}
+
+
+void USIEngine::loadhash(std::istringstream& cmdStream) {
+    std::string path;
+    std::getline(cmdStream >> std::ws, path);
+
+    if (engine.load_tt(path))
+        std::cout << "info string hash loaded from " << path << std::endl;
+    else
+        std::cout << "info string failed to load hash from " << path
+                  << " (missing file or different hash size)" << std::endl;
+}
+
+
 void USIManager::on_best_move(Move bestMove, Move ponderMove) {
     std::cout << "bestmove " << bestMove;
     if (!ponderMove.is_null())
@@ -208,7 +252,8 @@ void USIManager::on_iter(const SearchInfo& info) {
               << " score cp " << info.eval
               << " time "  << time.count()
               << " nodes " << info.nodeCount
-              << " nps " << nps;
+              << " nps " << nps
+              << " hashfull " << info.hashfull;
 
     std::cout << " pv";
     for (auto m : info.pv) {
@@ -36,6 +36,13 @@ class USIEngine {
         void gameover(std::istringstream& cmdStream);
         // void quit();
 
+        // non standard commands
+        // savehash <file>: dump the transposition table to a file
+        // loadhash <file>: reload a table dumped with savehash (same USI_Hash needed)
+        // stats: print the transposition table and eval cache stats summed over the threads
+        void savehash(std::istringstream& cmdStream);
+        void loadhash(std::istringstream& cmdStream);
+
         USIManager usiManager;
         Engine engine;
 };
@@ -1,25 +1,35 @@
 from pathlib import Path
-import numpy as np
 import torch
 from torch.utils.data import IterableDataset, DataLoader, get_worker_info
 
-from nnue_loader import load_data_batch
+from nnue_loader import DataStream
 
 
 class NNUEIterableDataset(IterableDataset):
+    # the files are loaded, shuffled and batched by the C++ DataStream, in its own threads.
+    # use it with num_workers=0: with more workers each one streams its share of the files
     def __init__(
         self, 
         data_path, 
         batch_size = 256, 
         shuffle = True, 
         random_hflip = False, 
-        hflip = False
+        hflip = False,
+        halfkp = False,
+        output_buckets = 1,
+        shuffle_buffer = 1 << 19,
+        num_threads = 0
     ):
-        self.files = list(Path(data_path).rglob("*.txt"))
+        # text ("sfen | score | result" lines) or packed (.bin) gensfen files
+        self.files = [f for f in Path(data_path).rglob("*") if f.suffix in (".txt", ".bin")]
         self.batch_size = batch_size
         self.shuffle = shuffle
         self.random_hflip = random_hflip
         self.hflip = hflip # always flip, overwritten by random_hflip
+        self.halfkp = halfkp # king relative features, needs HALF_KP in the model
+        self.output_buckets = output_buckets # NUM_OUTPUT_BUCKETS in the model
+        self.shuffle_buffer = shuffle_buffer # samples mixed across files
+        self.num_threads = num_threads # reader threads, 0 for all the cores
 
     def _files_fragment(self):
         info = get_worker_info()
@@ -29,73 +39,50 @@ class NNUEIterableDataset(IterableDataset):
 
 
     def __iter__(self):
-        files = self._files_fragment()
-
-        if self.shuffle:
-            np.random.shuffle(files)
-
-        carry_b = carry_w = carry_s = carry_r = carry_t = None
-
-        for file in files:
-            batch = load_data_batch(
-                file.as_posix(),
-                random_hflip=self.random_hflip,
-                hflip=self.hflip
+        stream = DataStream(
+            [file.as_posix() for file in self._files_fragment()],
+            self.batch_size,
+            shuffle=self.shuffle,
+            shuffle_buffer=self.shuffle_buffer,
+            num_threads=self.num_threads,
+            hflip=self.hflip,
+            random_hflip=self.random_hflip,
+            halfkp=self.halfkp,
+            output_buckets=self.output_buckets
+        )
+
+        # the tensors share the memory of the batch (no copy).
+        # the indexes are int16 piece features with the king bucket of each perspective apart,
+        # NNUEModel.forward puts them back together on the device
+        for batch in stream:
+            yield (
+                torch.from_numpy(batch.black_indexes),
+                torch.from_numpy(batch.white_indexes),
+                torch.from_numpy(batch.black_kings),
+                torch.from_numpy(batch.white_kings),
+                torch.from_numpy(batch.scores),
+                torch.from_numpy(batch.results),
+                torch.from_numpy(batch.stms),
+                torch.from_numpy(batch.buckets)
             )
-            b = torch.from_numpy(batch.black_indexes)
-            w = torch.from_numpy(batch.white_indexes)
-            s = torch.from_numpy(batch.scores)
-            r = torch.from_numpy(batch.results)
-            t = torch.from_numpy(batch.stms)
-
-            if self.shuffle:
-                perm = torch.randperm(b.size(0))
-                b, w, s, r, t = b[perm], w[perm], s[perm], r[perm], t[perm]
-            
-            # concatenate the carry from the previous file
-            if carry_b is not None:
-                b = torch.cat([carry_b, b], dim=0)
-                w = torch.cat([carry_w, w], dim=0)
-                s = torch.cat([carry_s, s], dim=0)
-                r = torch.cat([carry_r, r], dim=0)
-                t = torch.cat([carry_t, t], dim=0)
 
-            bs = self.batch_size
-            limit = (b.size(0) // bs) * bs # if the batch size is bigger, skip loop
-            for i in range(0, limit, bs):
-                batch_b = b[i:i+bs].clone()
-                batch_w = w[i:i+bs].clone()
-                batch_s = s[i:i+bs].clone()
-                batch_r = r[i:i+bs].clone()
-                batch_t = t[i:i+bs].clone()
-                yield (batch_b, batch_w, batch_s, batch_r, batch_t)
-            
-            carry_b = b[limit:].clone()
-            carry_w = w[limit:].clone()
-            carry_s = s[limit:].clone()
-            carry_r = r[limit:].clone()
-            carry_t = t[limit:].clone()
-        
-        # at the end, yield the remaining carry
-        if carry_b is not None:
-            if carry_b.size(0) > 0:
-                yield (carry_b, carry_w, carry_s, carry_r, carry_t) 
+        # packed records that are not valid (e.g. from a corrupt file) are skipped by the loader
+        if stream.skipped:
+            print(f"Skipped {stream.skipped} invalid records")
                 
 
 if __name__ == "__main__":
     dataloader = DataLoader(
         NNUEIterableDataset("data/nnue/train", batch_size=10000),
         batch_size=None, # batch handled by the dataset
-        num_workers=8,
+        num_workers=0, # threads handled by the dataset
         pin_memory=True,
-        persistent_workers=True,
-        prefetch_factor=2,
     )
 
     total = 0
     for batch in dataloader:
-        b, w, s, r, t = batch
-        print(b.shape, w.shape, s.shape, r.shape, t.shape)
+        b, w, bk, wk, s, r, t, k = batch
+        print(b.shape, w.shape, bk.shape, wk.shape, s.shape, r.shape, t.shape, k.shape)
 
         total += b.size(0)
 
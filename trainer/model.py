@@ -2,10 +2,24 @@ import torch
 from torch import nn
 import torch.nn.functional as F
 import numpy as np	
-
-NUM_FEATURES = 2344
+import struct
+
+# HALF_KP selects the king relative feature set (HalfKPFeatures in searchengine/src/nnue/features.h),
+# the piece features are repeated for every square of the own king
+HALF_KP = False
+PIECE_FEATURES = 2344
+NUM_FEATURES = PIECE_FEATURES * 81 if HALF_KP else PIECE_FEATURES
+# number of output heads, selected by the number of pieces in the hands
+# (output_bucket in searchengine/src/nnue/nnue.h), at most 8
+NUM_OUTPUT_BUCKETS = 1
 ACTIVE_FEATURES = 40
 ACCUMULATOR_SIZE = 32
+# (input, output) sizes of the dense layers after the feature transformer
+# (Architecture::LayerStackType in searchengine/src/nnue/nnue.h). the model layers, the network
+# file layout and the header hash are all generated from this list, so a deeper stack in the
+# engine only needs the same change here, e.g. [(2*acc, 16), (16, 32), (32, 1)]
+def layer_sizes(accumulator_size):
+    return [(2 * accumulator_size, 1)]
 
 class NNUEModel(nn.Module):
     def __init__(self):
@@ -13,7 +27,12 @@ class NNUEModel(nn.Module):
 
         self.l1 = nn.Embedding(NUM_FEATURES, ACCUMULATOR_SIZE)
         self.l1_bias = nn.Parameter(torch.zeros(ACCUMULATOR_SIZE))
-        self.l2 = nn.Linear(ACCUMULATOR_SIZE * 2, 1)
+        # one stack of dense layers per head, built from layer_sizes. only the head of the
+        # sample bucket is used. the layers are written in the same order in the network files
+        self.heads = nn.ModuleList([
+            nn.ModuleList([nn.Linear(n_in, n_out) for n_in, n_out in layer_sizes(ACCUMULATOR_SIZE)])
+            for _ in range(NUM_OUTPUT_BUCKETS)
+        ])
 
         std = 1/np.sqrt(NUM_FEATURES)
         nn.init.normal_(self.l1.weight, mean=0., std=std)
@@ -26,13 +45,18 @@ class NNUEModel(nn.Module):
         return torch.fake_quantize_per_tensor_affine(x, scale, 0, qmin, qmax)
 
 
-    def forward(self, black_features, white_features, stm):
+    @staticmethod
+    def feature_indexes(piece_features, king_buckets):
+        # the loader sends the int16 piece features and the king bucket of the perspective apart
+        return piece_features.long() + king_buckets.long().unsqueeze(-1) * PIECE_FEATURES
+
+
+    def forward(self, black_features, white_features, black_kings, white_kings, stm, bucket):
         q_l1w = self.fake_quantize(self.l1.weight, 127, -32768, 32767)
         q_l1b = self.fake_quantize(self.l1_bias, 127, -32768, 32767)
-        q_l2w = self.fake_quantize(self.l2.weight, 64, -128, 127)
-        # no need to fake quantize the l2 bias at int32 precision
-
 
+        black_features = self.feature_indexes(black_features, black_kings)
+        white_features = self.feature_indexes(white_features, white_kings)
         b_acc = F.embedding(black_features, q_l1w).sum(dim=1) + q_l1b
         w_acc = F.embedding(white_features, q_l1w).sum(dim=1) + q_l1b
 
@@ -43,26 +67,80 @@ class NNUEModel(nn.Module):
         )
 
         accumulator = torch.clamp(accumulator, min=0., max=1.)
-        return F.linear(accumulator, q_l2w, self.l2.bias)
+        output = torch.cat([self.head_forward(head, accumulator) for head in self.heads], dim=1)
+        return output.gather(1, bucket.long().unsqueeze(-1))
+
+
+    def head_forward(self, head, x):
+        # every layer but the last one is followed by a clipped relu (LayerStack in the engine).
+        # no need to fake quantize the biases at int32 precision
+        for i, layer in enumerate(head):
+            if i > 0:
+                x = torch.clamp(x, min=0., max=1.)
+            x = F.linear(x, self.fake_quantize(layer.weight, 64, -128, 127), layer.bias)
+        return x
     
 
-    def weights_to_bin(self, file_path):
+    def weights_to_bin(self, file_path, header=False):
+        # header=True writes a network file that can be loaded with the EvalFile option,
+        # otherwise the raw weights to embed in the engine
         with open(file_path, "wb") as f:
 
             l1_weights = self.l1.weight.data.clone().cpu().numpy()           # (NUM_FEATURES, ACCUMULATOR_SIZE)
             l1_bias = self.l1_bias.data.clone().cpu().numpy()                # (ACCUMULATOR_SIZE,)
-            l2_weights = self.l2.weight.data.clone().cpu().numpy().flatten() # (2*ACCUMULATOR_SIZE,)
-            l2_bias = self.l2.bias.data.clone().cpu().numpy()                # (1,)
 
             l1_weights = (l1_weights * 127)                           .round().astype(np.int16)
             l1_bias    = (l1_bias    * 127)                           .round().astype(np.int16)
-            l2_weights = (l2_weights * 64)    .clip(min=-128, max=127).round().astype(np.int8 )
-            l2_bias    = (l2_bias    * 127*64)                        .round().astype(np.int32)
 
-            f.write(l1_weights.tobytes())
-            f.write(l1_bias.tobytes())
-            f.write(l2_weights.tobytes())
-            f.write(l2_bias.tobytes())
+            payload = l1_weights.tobytes() + l1_bias.tobytes()
+            # the heads are stored one after the other, each one with its layers in order
+            # and every layer with its weights (out, in) and biases
+            for head in self.heads:
+                for layer in head:
+                    weights = layer.weight.data.clone().cpu().numpy()       # (out, in)
+                    bias = layer.bias.data.clone().cpu().numpy()            # (out,)
+
+                    weights = (weights * 64)    .clip(min=-128, max=127).round().astype(np.int8 )
+                    bias    = (bias    * 127*64)                        .round().astype(np.int32)
+                    payload += weights.tobytes() + bias.tobytes()
+            if header:
+                f.write(net_file_header(payload, output_buckets=NUM_OUTPUT_BUCKETS))
+            elif NUM_OUTPUT_BUCKETS != 1:
+                raise ValueError("the embedded network has a single head")
+            f.write(payload)
+
+
+def fnv1a(data):
+    h = 0xcbf29ce484222325
+    for b in data:
+        h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+
+# hash of the dense layer sizes (LayerStack::hash in searchengine/src/nnue/layers/layer_stack.h)
+def layers_hash(accumulator_size):
+    h = 2166136261
+    for n_in, n_out in layer_sizes(accumulator_size):
+        h = ((h ^ n_in) * 16777619) & 0xffffffff
+        h = ((h ^ n_out) * 16777619) & 0xffffffff
+    return h
+
+
+# header of the network files read by the engine (NetFileHeader in searchengine/src/nnue/nnue.cpp)
+def net_file_header(payload, accumulator_size=ACCUMULATOR_SIZE, output_buckets=1):
+    # 64 bytes, padded so that the weights start on a cache line
+    return struct.pack("<8sIIIIIIQQ16x", b"HARUKANN", 4, NUM_FEATURES, accumulator_size,
+                       layers_hash(accumulator_size), output_buckets, 0, len(payload), fnv1a(payload))
+
+
+# add the header to raw weights (e.g. the nets in searchengine/bin/nnue)
+# so that they can be loaded with the EvalFile option
+def bin_to_net(bin_path, net_path, accumulator_size):
+    with open(bin_path, "rb") as f:
+        payload = f.read()
+    with open(net_path, "wb") as f:
+        f.write(net_file_header(payload, accumulator_size))
+        f.write(payload)
 
 
 if __name__ == "__main__":
@@ -70,8 +148,8 @@ if __name__ == "__main__":
     from nnue_loader import load_data_batch
     batch = load_data_batch("data/gensfen/data_0/0.txt")
 
-    b_features = torch.tensor(batch.black_indexes)
-    w_features = torch.tensor(batch.white_indexes)
+    b_features = NNUEModel.feature_indexes(torch.tensor(batch.black_indexes), torch.tensor(batch.black_kings))
+    w_features = NNUEModel.feature_indexes(torch.tensor(batch.white_indexes), torch.tensor(batch.white_kings))
     stm = torch.tensor(batch.stms)
 
     model = NNUEModel()
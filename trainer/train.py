@@ -4,7 +4,7 @@ from torch.optim import SGD, AdamW
 from torch.optim.lr_scheduler import CosineAnnealingLR, StepLR, ExponentialLR
 from torch.utils.data import DataLoader
 
-from model import NNUEModel
+from model import NNUEModel, HALF_KP, NUM_OUTPUT_BUCKETS
 from dataset import NNUEIterableDataset
 
 
@@ -22,19 +22,17 @@ def crossentropy_loss(output, target):
 
 model = NNUEModel().to(device)
 train_dataloader = DataLoader(
-    NNUEIterableDataset("data/nnue/train", batch_size=16384, random_hflip=True),
+    NNUEIterableDataset("data/nnue/train", batch_size=16384, random_hflip=True, halfkp=HALF_KP,
+                        output_buckets=NUM_OUTPUT_BUCKETS),
     batch_size=None,
-    num_workers=16,
-    persistent_workers=True,
-    prefetch_factor=4,
+    num_workers=0, # the dataset loads the data in its own threads
     pin_memory=True,
 )
 val_dataloader = DataLoader(
-    NNUEIterableDataset("data/nnue/val", batch_size=16384, random_hflip=False, shuffle=False),
+    NNUEIterableDataset("data/nnue/val", batch_size=16384, random_hflip=False, shuffle=False, halfkp=HALF_KP,
+                        output_buckets=NUM_OUTPUT_BUCKETS),
     batch_size=None,
-    num_workers=16,
-    persistent_workers=True,
-    prefetch_factor=4,
+    num_workers=0, # the dataset loads the data in its own threads
     pin_memory=True,
 )
 optimizer = AdamW(model.parameters(), lr=1e-3, weight_decay=1e-2)
@@ -45,11 +43,11 @@ val_losses = []
 min_val_loss = float('inf')
 for epoch in range(EPOCHS):
     for batch in train_dataloader:
-        b, w, s, r, t = [tensor.to(device) for tensor in batch]
+        b, w, bk, wk, s, r, t, k = [tensor.to(device) for tensor in batch]
 
         s = s/(127*64)
         
-        output = torch.sigmoid(model(b, w, t))
+        output = torch.sigmoid(model(b, w, bk, wk, t, k))
         target = (LAMBDA*torch.sigmoid(s*4) + (1 - LAMBDA)*r).unsqueeze(-1)
 
         loss = crossentropy_loss(output, target)
@@ -62,12 +60,12 @@ for epoch in range(EPOCHS):
 
     
     for batch in val_dataloader:
-        b, w, s, r, t = [tensor.to(device) for tensor in batch]
+        b, w, bk, wk, s, r, t, k = [tensor.to(device) for tensor in batch]
 
         s = s/(127*64)
         
         with torch.no_grad():
-            output = torch.sigmoid(model(b, w, t))
+            output = torch.sigmoid(model(b, w, bk, wk, t, k))
         target = (LAMBDA*torch.sigmoid(s*4) + (1 - LAMBDA)*r).unsqueeze(-1)
 
         loss = crossentropy_loss(output, target)